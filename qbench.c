@@ -0,0 +1,440 @@
+/* qbench.c - qnx_acc read path benchmarks (see qgen for test images)
+ * uses qnx_acc library
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* Micro benchmarks (qd_read, qnx_read, qnx_seek) and macro benchmarks
+ * (directory listing, path lookup, extraction) on one image. The tree is
+ * walked once up front to get the file list. Caches are as qdump sets
+ * them up (-c), the OS page cache is whatever it is - run twice, or drop
+ * it in between, for warm/cold numbers. System calls are those made on
+ * the image (qd_image counters, none for mapped images) plus, for
+ * extraction, the output file calls; they are given per operation and per
+ * MB of data read (directory data for listing). */
+
+#define _GNU_SOURCE	/* asprintf */
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "qnx_acc.h"
+#include "qnx_rand.h"
+
+#define QB_BUFSIZE	(64*1024)	/* read size for sequential reads */
+#define QB_SEEKFILES 256		/* files kept open for the seek benchmark */
+#define QB_SEEKREAD	4096
+#define DEF_CACHE_SLOTS 256
+#define DEF_DIRHASH 64
+
+typedef struct qbfile
+{
+	char *path;
+	struct q_dir_entry de;
+} qbfile;
+
+typedef struct qbench
+{
+	qnx_disk *qd;
+	qbfile *f;			/* files, then directories (from nf on) */
+	uint32_t nf,nd,cap;
+	uint32_t nops;		/* operations for the random benchmarks */
+	char *dpath;		/* extraction destination (NULL - /dev/null) */
+	uint8_t *buf;
+	uint64_t rng;
+	double t0;
+	uint64_t sys0;
+} qbench;
+
+static double qb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void qb_start(qbench *b)
+{
+	b->sys0=b->qd->img->nsys;
+	b->t0=qb_now();
+}
+
+/* one result line; xsys - system calls made by the benchmark itself */
+static void qb_report(qbench *b, const char *name, uint64_t bytes, uint64_t ops, uint64_t xsys)
+{
+	double t=qb_now()-b->t0;
+	double mb=bytes/1048576.0;
+	uint64_t sys=b->qd->img->nsys-b->sys0+xsys;
+
+	if(t<=0)
+		t=1e-9;
+	printf("%-14s %9.3f s %12.0f ops/s %8.2f sys/op",name,t,ops/t,ops ? (double)sys/ops : 0.0);
+	if(bytes)
+		printf(" %10.1f MB/s %9.1f sys/MB\n",mb/t,sys/mb);
+	else
+		printf("\n");
+}
+
+static int qb_add(qbench *b, const char *dir, struct q_dir_entry *de)
+{
+	qbfile *nf;
+
+	if(b->nf+b->nd==b->cap)
+	{
+		b->cap=b->cap ? b->cap*2 : 1024;
+		if((nf=realloc(b->f,b->cap*sizeof(qbfile)))==NULL)
+			func_abort("alloc error!");
+		b->f=nf;
+	}
+	nf=&b->f[b->nf+b->nd];
+	if(asprintf(&nf->path,"%s/%.*s",dir,QNX_MAXFNLEN,de->fname)<0)
+		func_abort("alloc error!");
+	memcpy(&nf->de,de,sizeof(struct q_dir_entry));
+	if(de->fattr & QFA_DIRECTORY)
+		b->nd++;
+	else
+		b->nf++;
+	return 0;
+}
+
+/* collect everything below directory fd (path dir); files and directories
+ * are sorted apart afterwards. fails if any subtree can't be read, timings
+ * of a partial tree would be misleading */
+static int qb_walk(qbench *b, qnx_file *fd, const char *dir, int depth)
+{
+	qnx_diter it;
+	struct q_dir_entry *de;
+	qnx_file sfd;
+	uint32_t first=b->nf+b->nd,i,n;
+
+	if(depth>64 || qnx_diter_init(&it,fd))
+	{
+		fprintf(stderr,"%s: %s\n",dir[0] ? dir : "/",depth>64 ? "directories nested too deep" : "can't read directory");
+		return -1;
+	}
+	while((de=qnx_diter_next(&it))!=NULL)
+		if(qb_add(b,dir,de))
+		{
+			qnx_diter_close(&it);
+			return -1;
+		}
+	qnx_diter_close(&it);
+	n=b->nf+b->nd;
+	for(i=first;i<n;i++)
+	{
+		if(!(b->f[i].de.fattr & QFA_DIRECTORY))
+			continue;
+		if(qnx_de2fd(b->qd,&b->f[i].de,&sfd))
+			return -1;
+		if(qb_walk(b,&sfd,b->f[i].path,depth+1))
+		{
+			qnx_close(&sfd);
+			return -1;
+		}
+		qnx_close(&sfd);
+	}
+	return 0;
+}
+
+static int qb_cmp(const void *a, const void *b)
+{
+	return (((qbfile *)a)->de.fattr & QFA_DIRECTORY)-(((qbfile *)b)->de.fattr & QFA_DIRECTORY);
+}
+
+/* sequential and random (single block) image reads */
+static void qb_qd_read(qbench *b)
+{
+	qnx_disk *qd=b->qd;
+	uint64_t size=qd->isize-qd->ioff,off;
+	uint32_t n,i;
+
+	qb_start(b);
+	for(off=0,i=0;off<size;off+=n,i++)
+	{
+		n=MIN(size-off,QB_BUFSIZE);
+		if(qd_read(qd,b->buf,off,n))
+			break;
+	}
+	qb_report(b,"qd_read seq",off,i,0);
+
+	qb_start(b);
+	for(i=0;i<b->nops && size>=Q_BLOCKSIZE;i++)
+		if(qd_read(qd,b->buf,(uint64_t)(qnx_rand(&b->rng)%(size/Q_BLOCKSIZE))*Q_BLOCKSIZE,Q_BLOCKSIZE))
+			break;
+	qb_report(b,"qd_read rand",(uint64_t)i*Q_BLOCKSIZE,i,0);
+}
+
+/* all files, whole, through qnx_read */
+static void qb_qnx_read(qbench *b)
+{
+	qnx_file fd;
+	uint64_t bytes=0;
+	uint32_t i;
+	int32_t r;
+
+	qb_start(b);
+	for(i=0;i<b->nf;i++)
+	{
+		if(qnx_de2fd(b->qd,&b->f[i].de,&fd))
+			continue;
+		while((r=qnx_read(&fd,b->buf,QB_BUFSIZE))>0)
+			bytes+=r;
+		qnx_close(&fd);
+	}
+	qb_report(b,"qnx_read",bytes,b->nf,0);
+}
+
+/* random seek + short read in (up to QB_SEEKFILES) open files */
+static void qb_qnx_seek(qbench *b)
+{
+	qnx_file *fd;
+	uint32_t n=0,i,k;
+	uint64_t bytes=0;
+	int32_t r;
+
+	if((fd=calloc(QB_SEEKFILES,sizeof(qnx_file)))==NULL)
+		return;
+	for(i=0;i<b->nf && n<QB_SEEKFILES;i++)
+		if(!qnx_de2fd(b->qd,&b->f[i].de,&fd[n]) && fd[n].fsize>QB_SEEKREAD)
+			n++;
+		else
+			qnx_close(&fd[n]);
+	if(n)
+	{
+		qb_start(b);
+		for(i=0;i<b->nops;i++)
+		{
+			k=qnx_rand(&b->rng)%n;
+			if(qnx_seek(&fd[k],qnx_rand(&b->rng)%(fd[k].fsize-QB_SEEKREAD))<0)
+				break;
+			if((r=qnx_read(&fd[k],b->buf,QB_SEEKREAD))>0)
+				bytes+=r;
+		}
+		qb_report(b,"qnx_seek",bytes,i,0);
+	}
+	for(i=0;i<n;i++)
+		qnx_close(&fd[i]);
+	free(fd);
+}
+
+/* every directory, entries with sizes (as qdump -d) */
+static void qb_list(qbench *b)
+{
+	qnx_file fd;
+	qnx_diter it;
+	struct q_dir_entry *de;
+	uint64_t n=0,bytes=0;
+	uint32_t i;
+
+	qb_start(b);
+	for(i=b->nf;i<b->nf+b->nd;i++)
+	{
+		if(qnx_de2fd(b->qd,&b->f[i].de,&fd))
+			continue;
+		bytes+=fd.fsize;
+		if(!qnx_diter_init(&it,&fd))
+		{
+			it.pfent=1;
+			while((de=qnx_diter_next(&it))!=NULL)
+			{
+				qnx_filesize(b->qd,de);
+				n++;
+			}
+			qnx_diter_close(&it);
+		}
+		qnx_close(&fd);
+	}
+	qb_report(b,"list",bytes,n,0);
+}
+
+/* open every file by path, in random order */
+static void qb_lookup(qbench *b)
+{
+	qnx_file fd;
+	uint32_t *ord,i,j,t;
+
+	if(!b->nf || (ord=malloc(b->nf*sizeof(uint32_t)))==NULL)
+		return;
+	for(i=0;i<b->nf;i++)
+		ord[i]=i;
+	for(i=b->nf-1;i>0;i--)
+	{
+		j=qnx_rand(&b->rng)%(i+1);
+		t=ord[i];
+		ord[i]=ord[j];
+		ord[j]=t;
+	}
+	qb_start(b);
+	for(i=0;i<b->nf;i++)
+		if(!q_open_file(b->qd,b->f[ord[i]].path,&fd))
+			qnx_close(&fd);
+	qb_report(b,"lookup",0,b->nf,0);
+	free(ord);
+}
+
+/* every file to its own output file (or /dev/null) */
+static void qb_extract(qbench *b)
+{
+	qnx_file fd;
+	uint64_t bytes=0,xsys=0;
+	uint32_t i;
+	int32_t r;
+	int ofd;
+	char fn[32];
+
+	qb_start(b);
+	for(i=0;i<b->nf;i++)
+	{
+		if(qnx_de2fd(b->qd,&b->f[i].de,&fd))
+			continue;
+		if(b->dpath!=NULL)
+		{
+			snprintf(fn,sizeof(fn),"%u",i);
+			ofd=open(fn,O_CREAT | O_TRUNC | O_WRONLY,0644);
+		}
+		else
+			ofd=open("/dev/null",O_WRONLY);
+		xsys+=2;	/* open, close */
+		if(ofd<0)
+		{
+			qnx_close(&fd);
+			continue;
+		}
+		while((r=qnx_read(&fd,b->buf,QB_BUFSIZE))>0)
+		{
+			if(write(ofd,b->buf,r)!=r)
+				break;
+			xsys++;
+			bytes+=r;
+		}
+		close(ofd);
+		qnx_close(&fd);
+	}
+	qb_report(b,"extract",bytes,b->nf,xsys);
+}
+
+void exit_usage(char *pn, int rv)
+{
+	printf("Usage: %s <disk_image> [-m] [-P] [-2] [-c slots] [-n ops] [-l local_path]\n",pn);
+	printf("\t-m\tmemory-map image file\n");
+	printf("\t-P\tprefetch (see qdump -P)\n");
+	printf("\t-2\tQNX 2.x image (file sizes from directory entries)\n");
+	printf("\t-c\tsector cache size in %d byte slots (default %d, max %d, 0 disables)\n",Q_BLOCKSIZE,DEF_CACHE_SLOTS,QC_MAXSLOTS);
+	printf("\t-n\toperations for the random read and seek benchmarks (default 20000)\n");
+	printf("\t-l\textract to local_path (files named by number) instead of /dev/null\n");
+	exit(rv);
+}
+
+int main(int argc, char *argv[])
+{
+	qnx_disk qd;
+	qnx_file root;
+	qbench b;
+	uint64_t v;
+	int or,e=0,oflags=0;
+	int cslots=DEF_CACHE_SLOTS;
+	uint32_t i;
+
+	memset(&b,0,sizeof(b));
+	b.nops=20000;
+	b.rng=1;
+	while((or=getopt(argc,argv,"mP2c:n:l:"))!=-1)
+	{
+		switch(or)
+		{
+			case 'm':
+				oflags |= QDO_MMAP;
+				break;
+			case 'P':
+				oflags |= QDO_PREFETCH;
+				break;
+			case '2':
+				oflags |= QDO_QNX2;
+				break;
+			case 'c':
+				if(q_strtonum(optarg,QC_MAXSLOTS,&v))
+					e=1;
+				else
+					cslots=v;
+				break;
+			case 'n':
+				if(q_strtonum(optarg,UINT32_MAX,&v))
+					e=1;
+				else
+					b.nops=v;
+				break;
+			case 'l':
+				b.dpath=optarg;
+				break;
+			default:
+				e=1;
+				break;
+		}
+	}
+	if(e || optind>=argc)
+		exit_usage(argv[0],EXIT_FAILURE);
+
+	if(qd_open(&qd,argv[optind],0,oflags))
+	{
+		fprintf(stderr,"Unable to open image file %s\n",argv[optind]);
+		return 1;
+	}
+	b.qd=&qd;
+	if(cslots>0 && qd_cache_init(&qd,cslots))
+		fprintf(stderr,"Unable to allocate sector cache, continuing without it\n");
+	if(qd_dirhash_init(&qd,DEF_DIRHASH))
+		fprintf(stderr,"Unable to allocate directory hash tables, continuing without them\n");
+	if((b.buf=malloc(QB_BUFSIZE))==NULL || qnx_open_root(&qd,&root) || qb_walk(&b,&root,"",0))
+	{
+		fprintf(stderr,"Unable to read the tree of %s\n",argv[optind]);
+		qd_close(&qd);
+		return 1;
+	}
+	qnx_close(&root);
+	qsort(b.f,b.nf+b.nd,sizeof(qbfile),qb_cmp);
+	if(b.dpath!=NULL && chdir(b.dpath))
+	{
+		fprintf(stderr,"Unable to use %s\n",b.dpath);
+		return 1;
+	}
+
+	printf("%s: %u files, %u directories, %" PRIu64 " bytes%s%s\n",argv[optind],b.nf,b.nd,qd.isize,
+		(qd.oflags & QDO_MMAP) ? ", mapped" : "",(qd.oflags & QDO_PREFETCH) ? ", prefetch" : "");
+	qb_list(&b);
+	qb_lookup(&b);
+	qb_qd_read(&b);
+	qb_qnx_read(&b);
+	qb_qnx_seek(&b);
+	qb_extract(&b);
+
+	for(i=0;i<b.nf+b.nd;i++)
+		free(b.f[i].path);
+	free(b.f);
+	free(b.buf);
+	qd_close(&qd);
+	return 0;
+}
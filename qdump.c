@@ -20,6 +20,7 @@
  * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
  * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
  */
+#define _GNU_SOURCE	/* copy_file_range */
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
@@ -28,62 +29,85 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD
+#endif
 
 #include "qnx_acc.h"
+#include "qnx_idx.h"
+#include "qnx_scan.h"
+#include "qnx_ur.h"
 
 /* ops */
 #define OP_DIR 1
 #define OP_EXTRACT 2
 #define OP_DUMP 3
+#define OP_TAR 4
 
 
+/* default sector cache size (slots of Q_BLOCKSIZE) */
+#define DEF_CACHE_SLOTS 256
+
+/* number of large directories to keep hash tables for */
+#define DEF_DIRHASH 64
+
+/* default memory (per extracting thread) for streaming buffers, in KB */
+#define DEF_XBUF_KB 1024
+
+/* max -d/-r/-x options on the command line */
+#define MAX_OPS 64
+
+/* max worker threads for -j and extraction job queue length */
+#define MAX_JOBS 64
+#define XQ_LEN 256
+
+/* io_uring extraction (-U): operations (and buffers) in flight, files
+ * being extracted at the same time, max. bytes per operation */
+#define XR_DEPTH 64
+#define XR_FILES 32
+#define XR_CHUNK (64*1024)
+
+/* max. partitions read from the partition table */
+#define MAX_PARTS 64
+
 /* options */
 #define OPT_ASCII 1
+#define OPT_MMAP 2
+#define OPT_QNX2 4
+#define OPT_GZIDX 8
+#define OPT_SCAN 16
+#define OPT_PREFETCH 32
 
 /* "local" (file) helper */
-/* write buf to file, passing of and cm to open(2) 
- * returns 0 on success */
-int buf2file(void *buf, char* fn, int l, int of, int cm)
+/* write all l bytes of buf to fd, returns 0 on success */
+int write_all(int fd, void *buf, size_t l)
 {
-	int r;
-	size_t rb=l;
+	ssize_t r;
 	char *dbuf=(char *)buf;
-	if(fn==NULL)
-	{
-		fprintf(stderr,"File name is NULL in buf2file!\n");
-		return -1;
-	}
-	int fd=open(fn,of,cm);
-	if(fd<1)
-	{
-		fprintf(stderr,"Unable to open or create %s\n",fn);
-		return -1;
-	}
-	while(rb)
+	while(l)
 	{
 		r=write(fd,dbuf,l);
 		if(r<0)
-		{
-			fprintf(stderr,"Write error for %s\n",fn);
-			close(fd);
 			return -1;
-		}
-
-		rb-=r;
+		l-=r;
 		dbuf+=r;
 	}
-	close(fd);
 	return 0;
 }
 
 /* qnx helpers */
-void disp_qdir(qnx_disk *qd,struct q_dir_entry *d)
+static qnx_index *xqi=NULL;	/* index (-I) or NULL */
+
+/* display directory entry with (already known) size */
+void disp_qdent(struct q_dir_entry *d, int32_t fsize)
 {
 	char name[18];
 	char isdir=' ';
-	int32_t fsize;
 
-	fsize=qnx_filesize(qd,d);
 	if(!d->fname[0]) return;	/* do not display entries with no name */
 	if(d->fattr & QFA_DIRECTORY)
 		isdir='+';
@@ -95,13 +119,45 @@ void disp_qdir(qnx_disk *qd,struct q_dir_entry *d)
 	printf("\tBC: %u\tCF: %u\n",d->fnum_blks,d->fnum_chars_free); */
 }
 
+void disp_qdir(qnx_disk *qd,struct q_dir_entry *d)
+{
+	if(!d->fname[0]) return;
+	disp_qdent(d,qnx_filesize(qd,d));
+}
+
 void disp_qnxdir(qnx_file *fd)
 {
+	struct q_dir_entry *de;
+	qnx_diter it;
+
+	if(qnx_diter_init(&it,fd))
+		return;
+	it.pfent=1;	/* sizes need the first extent headers */
+	while((de=qnx_diter_next(&it))!=NULL)
+		disp_qdir(fd->qd,de);
+	qnx_diter_close(&it);
+}
+
+/* list directory di from index - no disk access */
+void disp_qidir(uint32_t di)
+{
+	const struct qi_entry *e=&xqi->ent[di];
+	uint32_t i;
 	struct q_dir_entry de;
-	qnx_dir_init(fd);
 
-	while(!qnx_dir_nextentry(fd,&de))
-		disp_qdir(fd->qd,&de);
+	for(i=e->child;i<e->child+e->nchild;i++)
+	{
+		memcpy(&de,&xqi->ent[i].de,sizeof(struct q_dir_entry));
+		disp_qdent(&de,xqi->ent[i].fsize);
+	}
+}
+
+/* open directory entry de; ei is its index entry (QI_NONE if unknown) */
+int q_open_de(qnx_disk *qd, struct q_dir_entry *de, uint32_t ei, qnx_file *fd)
+{
+	if(xqi!=NULL && ei!=QI_NONE)
+		return qi_open_file(xqi,qd,ei,fd);
+	return qnx_de2fd(qd,de,fd);
 }
 
 
@@ -110,60 +166,373 @@ void disp_xtnt_hdr(struct q_xtnt_header *h)
 	printf("Extent: p=%u, n=%u, s=%u, b=%u\n",h->prev_xtnt,h->next_xtnt,h->size_xtnt,h->bound_xtnt);
 }
 
-void q_convrs(uint8_t *buf, uint32_t l)
+/* RS to LF conversion, copying l bytes from src to dst (can be the same
+ * buffer). SSE2/AVX2 versions are picked at runtime when available */
+static void q_convrs_scalar(uint8_t *dst, const uint8_t *src, size_t l)
 {
 	while(l--)
 	{
-		if(*buf==0x1e) *buf=0x0a;
-		buf++;
+		*dst++ = (*src==0x1e) ? 0x0a : *src;
+		src++;
 	}
 }
 
-int32_t q_file2lbuf(qnx_file *fd, uint8_t **dbuf)
+#ifdef HAVE_X86_SIMD
+/* x ^ (0x1e ^ 0x0a) turns RS into LF, applied only where x==RS */
+__attribute__((target("sse2")))
+static void q_convrs_sse2(uint8_t *dst, const uint8_t *src, size_t l)
 {
-	uint8_t *buf;
+	const __m128i rs=_mm_set1_epi8(0x1e);
+	const __m128i fx=_mm_set1_epi8(0x1e ^ 0x0a);
+	__m128i v;
+
+	for(;l>=16;l-=16,src+=16,dst+=16)
+	{
+		v=_mm_loadu_si128((const __m128i *)src);
+		v=_mm_xor_si128(v,_mm_and_si128(_mm_cmpeq_epi8(v,rs),fx));
+		_mm_storeu_si128((__m128i *)dst,v);
+	}
+	q_convrs_scalar(dst,src,l);
+}
+
+__attribute__((target("avx2")))
+static void q_convrs_avx2(uint8_t *dst, const uint8_t *src, size_t l)
+{
+	const __m256i rs=_mm256_set1_epi8(0x1e);
+	const __m256i fx=_mm256_set1_epi8(0x1e ^ 0x0a);
+	__m256i v;
+
+	for(;l>=32;l-=32,src+=32,dst+=32)
+	{
+		v=_mm256_loadu_si256((const __m256i *)src);
+		v=_mm256_xor_si256(v,_mm256_and_si256(_mm256_cmpeq_epi8(v,rs),fx));
+		_mm256_storeu_si256((__m256i *)dst,v);
+	}
+	q_convrs_scalar(dst,src,l);
+}
+#endif
+
+static void (*convrs_fn)(uint8_t *, const uint8_t *, size_t)=q_convrs_scalar;
+static pthread_once_t convrs_once=PTHREAD_ONCE_INIT;
+
+static void q_convrs_select(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		convrs_fn=q_convrs_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		convrs_fn=q_convrs_sse2;
+#endif
+}
+
+void q_convrs_copy(uint8_t *dst, const uint8_t *src, size_t l)
+{
+	pthread_once(&convrs_once,q_convrs_select);
+	convrs_fn(dst,src,l);
+}
+
+void q_convrs(uint8_t *buf, uint32_t l)
+{
+	q_convrs_copy(buf,buf,l);
+}
+
+/* streaming copy: the file is read in chunks into one of two buffers while
+ * a writer thread writes the other one, so memory use is bounded by
+ * xbufsize regardless of file size. buffers and writer belong to the
+ * calling thread and are kept for all files it copies (the writer is
+ * started with the first file that needs it) */
+typedef struct qstream
+{
+	uint8_t *buf[2];
+	uint32_t bsize;	/* size of each buffer */
+	uint32_t len[2];
+	int full[2];	/* buffer waiting to be written */
+	int wi;			/* buffer the writer takes next */
+	int quit;		/* writer should exit (qstream_free) */
+	int err;		/* writer failed (current file) */
+	int ofd;
+	int wrun;		/* writer thread started */
+	pthread_t wt;
+	pthread_mutex_t m;
+	pthread_cond_t c;
+} qstream;
+
+static uint32_t xbufsize=DEF_XBUF_KB*1024;	/* total for both buffers */
+static int xuring=0;	/* -U: extract directories through io_uring if possible */
+static __thread qstream *tqs=NULL;
+
+static void *qstream_writer(void *arg);
+
+static qstream *qstream_get(void)
+{
+	qstream *qs;
+	if(tqs!=NULL)
+		return tqs;
+	if((qs=calloc(1,sizeof(qstream)))==NULL)
+		return NULL;
+	qs->bsize=MAX(xbufsize/2,Q_BLOCKSIZE);
+	qs->buf[0]=malloc(qs->bsize);
+	qs->buf[1]=malloc(qs->bsize);
+	if(qs->buf[0]==NULL || qs->buf[1]==NULL)
+	{
+		free(qs->buf[0]);
+		free(qs->buf[1]);
+		free(qs);
+		return NULL;
+	}
+	pthread_mutex_init(&qs->m,NULL);
+	pthread_cond_init(&qs->c,NULL);
+	return tqs=qs;
+}
+
+/* release this thread's stream buffers */
+static void qstream_free(void)
+{
+	if(tqs==NULL)
+		return;
+	if(tqs->wrun)
+	{
+		pthread_mutex_lock(&tqs->m);
+		tqs->quit=1;
+		pthread_cond_broadcast(&tqs->c);
+		pthread_mutex_unlock(&tqs->m);
+		pthread_join(tqs->wt,NULL);
+	}
+	pthread_mutex_destroy(&tqs->m);
+	pthread_cond_destroy(&tqs->c);
+	free(tqs->buf[0]);
+	free(tqs->buf[1]);
+	free(tqs);
+	tqs=NULL;
+}
+
+static void *qstream_writer(void *arg)
+{
+	qstream *qs=(qstream *)arg;
+	int i,err;
+	int r;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&qs->m);
+		while(!qs->full[qs->wi] && !qs->quit)
+			pthread_cond_wait(&qs->c,&qs->m);
+		if(!qs->full[qs->wi])	/* quit and nothing left */
+		{
+			pthread_mutex_unlock(&qs->m);
+			break;
+		}
+		i=qs->wi;
+		err=qs->err;
+		pthread_mutex_unlock(&qs->m);
+
+		/* after an error the rest of the file is dropped */
+		r=err ? 0 : write_all(qs->ofd,qs->buf[i],qs->len[i]);
+
+		pthread_mutex_lock(&qs->m);
+		qs->full[i]=0;
+		qs->wi=i^1;
+		if(r)
+			qs->err=1;
+		pthread_cond_broadcast(&qs->c);
+		pthread_mutex_unlock(&qs->m);
+	}
+	return NULL;
+}
+
+/* qnx_read, plus optional RS conversion. For mapped images the conversion
+ * is done while copying out of the mapping (no separate pass) */
+int32_t q_read_conv(qnx_file *fd, uint8_t *buf, uint32_t count, int optrs)
+{
+	int32_t br;
+	uint32_t rb,n;
+	const uint8_t *src;
+
+	if(!optrs || fd->qd->map==NULL)
+	{
+		br=qnx_read(fd,buf,count);
+		if(br>0 && optrs)
+			q_convrs(buf,br);
+		return br;
+	}
+
+	if(fd->iflags & QIF_ERR)
+		return -1;
+	if(count > fd->fsize - fd->fpos)
+		count=fd->fsize - fd->fpos;
+	rb=count;
+	while(rb && !(fd->iflags & QIF_ATEOF))
+	{
+		/* xsize was checked against image size in qnx_set_fd_xtnt */
+		n=MIN(rb,fd->xsize - fd->xpos);
+		if(!n)
+			break;
+		src=qd_map(fd->qd,QBN2OFF(fd->crtx)+sizeof(struct q_xtnt_header)+fd->xpos,n);
+		if(src==NULL)
+			return (rb!=count) ? (int32_t)(count-rb) : -1;
+		q_convrs_copy(buf,src,n);
+		buf+=n;
+		fd->xpos+=n;
+		fd->fpos+=n;
+		rb-=n;
+		qnx_advance_xtnt(fd);
+	}
+	return count-rb;
+}
+
+/* copy whole qnx file fd to (local) file descriptor ofd */
+int q_file2fd(qnx_file *fd, int ofd, int optrs)
+{
+	qstream *qs=qstream_get();
 	int32_t br;
-	buf=malloc(fd->fsize+1);
-	if(buf==NULL)
-		func_abort("malloc error");
+	int i=0;
+	int rv=0,err;
+
+	if(qs==NULL)
+		func_abort("can't allocate stream buffers");
 	if(fd->fpos)
 		qnx_seek(fd,0);
 
-	/* in the unlikely event that qnx_read doesn't read everyhting in one go
-	 * it's useless to retry :) so we're happy with what it gives us */
-	if((br=qnx_read(fd,buf,fd->fsize))<1)	/* unless it's an error */
-		func_abort("read error");
-	/* add nul-terminator for optional processing as a string */
-	buf[br]=0;
-	*dbuf=buf;
-	return br;
+	/* fits in one buffer - no need for a writer thread */
+	if(fd->fsize <= qs->bsize)
+	{
+		if((br=q_read_conv(fd,qs->buf[0],fd->fsize,optrs))!=fd->fsize)
+			func_abort("read error");
+		return write_all(ofd,qs->buf[0],br);
+	}
+
+	if(!qs->wrun)
+	{
+		if(pthread_create(&qs->wt,NULL,qstream_writer,qs))
+			func_abort("can't start writer thread");
+		qs->wrun=1;
+	}
+	/* the writer is idle here: both buffers were written (or dropped) */
+	pthread_mutex_lock(&qs->m);
+	qs->ofd=ofd;
+	qs->wi=0;
+	qs->err=0;
+	pthread_mutex_unlock(&qs->m);
+
+	while(fd->fpos < fd->fsize)
+	{
+		pthread_mutex_lock(&qs->m);
+		while(qs->full[i] && !qs->err)
+			pthread_cond_wait(&qs->c,&qs->m);
+		pthread_mutex_unlock(&qs->m);
+		if(qs->err)
+			break;
+
+		if((br=q_read_conv(fd,qs->buf[i],qs->bsize,optrs))<=0)
+		{
+			func_msg("read error at %u",fd->fpos);
+			rv=-1;
+			break;
+		}
+
+		pthread_mutex_lock(&qs->m);
+		qs->len[i]=br;
+		qs->full[i]=1;
+		pthread_cond_broadcast(&qs->c);
+		pthread_mutex_unlock(&qs->m);
+		i^=1;
+	}
+
+	/* wait until both buffers are written before the file is closed */
+	pthread_mutex_lock(&qs->m);
+	while(qs->full[0] || qs->full[1])
+		pthread_cond_wait(&qs->c,&qs->m);
+	err=qs->err;
+	pthread_mutex_unlock(&qs->m);
+	if(err)
+		func_abort("write error");
+	return rv;
 }
 
-int disp_qnxfile(qnx_file *fd, int optrs)
+/* in-kernel copy methods for q_file2fd_direct, tried in this order */
+#define CP_CFR 0		/* copy_file_range */
+#define CP_SENDFILE 1	/* sendfile */
+#define CP_RW 2			/* qd_read/write through stream buffer */
+
+/* copy len bytes at image offset ioff to ofd (at its current position)
+ * *m is the copy method, downgraded when the kernel refuses one */
+static int q_copy_range(qnx_disk *qd, off_t ioff, int ofd, size_t len, int *m)
 {
-	uint8_t *buf;
-	int32_t l;
-	l=q_file2lbuf(fd,&buf);
-	if(l<=0)
-		return 1;
-	if(optrs)
-		q_convrs(buf,l);
-	fwrite(buf,1,l,stdout);
-	free(buf);
+	ssize_t r=0;
+	qstream *qs;
+
+	while(len)
+	{
+		if(*m==CP_CFR)
+			r=copy_file_range(qd->fd,&ioff,ofd,NULL,len,0);
+		else if(*m==CP_SENDFILE)
+			r=sendfile(ofd,qd->fd,&ioff,len);
+		else
+		{
+			if((qs=qstream_get())==NULL)
+				func_abort("can't allocate stream buffers");
+			r=MIN(len,qs->bsize);
+			if(qd_read(qd,qs->buf[0],ioff-qd->ioff,r) || write_all(ofd,qs->buf[0],r))
+				return -1;
+			ioff+=r;
+		}
+		if(r<0 && *m<CP_RW && (errno==EXDEV || errno==EINVAL || errno==ENOSYS || errno==EOPNOTSUPP || errno==EBADF))
+		{
+			(*m)++;	/* not supported for these files, try next method */
+			continue;
+		}
+		if(r<=0)
+			func_abort("copy error at image offset %lld",(long long)ioff);
+		if(*m<CP_RW)	/* the kernel read it, not qd_read */
+			qd_prefetch_used(qd,ioff-r-qd->ioff,r);
+		len-=r;
+	}
 	return 0;
 }
 
-/* extract (already opened) qnx file fd to dpath
- * spath is needed because fd does not contain filename */
-int extract_qnxfile(qnx_file *fd, char *spath, char *dpath, int optrs)
+/* copy file data straight from the image to ofd, extent by extent,
+ * without going through user space buffers (binary files only) */
+int q_file2fd_direct(qnx_file *fd, int ofd)
 {
-	uint8_t *buf;
-	int32_t l;
+	uint32_t i;
+	uint32_t rb=fd->fsize;	/* remaining bytes */
+	uint32_t l;
+	int m=(fd->qd->oflags & QDO_NORAW) ? CP_RW : CP_CFR;	/* no raw data in fd */
+
+	if(fd->xmap==NULL && qnx_build_xmap(fd))
+		return -1;
+	for(i=0;i<fd->nxmap && rb;i++)
+	{
+		l=MIN(fd->xmap[i].size,rb);
+		if(i+1<fd->nxmap && l<rb)	/* next extent, while this one is copied */
+			qd_prefetch(fd->qd,QBN2OFF(fd->xmap[i+1].bn)+sizeof(struct q_xtnt_header),MIN(fd->xmap[i+1].size,rb-l));
+		if(q_copy_range(fd->qd,fd->qd->ioff+QBN2OFF(fd->xmap[i].bn)+sizeof(struct q_xtnt_header),ofd,l,&m))
+			return -1;
+		rb-=l;
+	}
+	if(rb)
+		fprintf(stderr,"Copy finished early, %u bytes missing\n",rb);
+	return 0;
+}
+
+int disp_qnxfile(qnx_file *fd, int optrs)
+{
+	fflush(stdout);
+	if(!optrs)
+		return q_file2fd_direct(fd,STDOUT_FILENO) ? 1 : 0;
+	return q_file2fd(fd,STDOUT_FILENO,optrs) ? 1 : 0;
+}
+
+/* create local file for (the last component of) spath in dpath and print
+ * its name; returns the open fd or -1 */
+int q_create_local(char *spath, char *dpath)
+{
+	int ofd;
 	char *dfn;
 	char *dempty="";
 	char *fn=strrchr(spath,'/');
 	size_t dpl,spl;
-	int rv=0;
 
 	if(fn==NULL)
 		fn=spath;
@@ -183,174 +552,947 @@ int extract_qnxfile(qnx_file *fd, char *spath, char *dpath, int optrs)
 		strcat(dfn,"/");
 	strcat(dfn,fn);
 
-	/* actual reading */
-	l=q_file2lbuf(fd,&buf);
-	if(l<=0)
+	ofd=open(dfn,O_CREAT | O_EXCL | O_WRONLY,0644);
+	if(ofd<0)
+		fprintf(stderr,"Unable to open or create %s\n",dfn);
+	else
+		printf("%s\n",dfn);
+	free(dfn);
+	return ofd;
+}
+
+/* extract (already opened) qnx file fd to dpath
+ * spath is needed because fd does not contain filename */
+int extract_qnxfile(qnx_file *fd, char *spath, char *dpath, int optrs)
+{
+	int ofd;
+	int rv=0;
+
+	if((ofd=q_create_local(spath,dpath))<0)
+		return -1;
+
+	/* read, convert (optional) and write */
+	if(optrs ? q_file2fd(fd,ofd,optrs) : q_file2fd_direct(fd,ofd))
 	{
 		func_msg("Unable to extract %s",spath);
 		rv=-1;
-		goto eofunc;
 	}
-
-	/* optional conversion */
-	if(optrs)
-		q_convrs(buf,l);
-
-	/* write */
-	printf("%s\n",dfn);
-	rv=buf2file(buf,dfn,l,O_CREAT | O_EXCL | O_WRONLY,0644);
-
-eofunc:
-	free(dfn);
+	close(ofd);
 	return rv;
 }
 
-int extract_qnxdir(qnx_file *dfd, char *dpath, int optrs)
+/* parallel extraction (-j): the directory walker queues files,
+ * worker threads open and extract them */
+typedef struct xjob
 {
-	qnx_file fd;
 	struct q_dir_entry de;
-	char *npath;
-	size_t dpl;
+	uint32_t ei;	/* index entry or QI_NONE */
+	char *dpath;	/* destination directory (owned by job) */
+} xjob;
+
+typedef struct xpool
+{
+	qnx_disk *qd;
+	int optrs;
+	int nth;
+	pthread_t th[MAX_JOBS];
+	xjob q[XQ_LEN];	/* circular job queue */
+	int qh,qn;		/* head, number of queued jobs */
+	int done;		/* walker finished, workers exit when queue is empty */
+	pthread_mutex_t m;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+} xpool;
 
-	qnx_dir_init(dfd);
+static xpool *xp=NULL;	/* NULL - extract sequentially */
 
-	while(!qnx_dir_nextentry(dfd,&de))
+static void *xpool_worker(void *arg)
+{
+	xpool *p=(xpool *)arg;
+	xjob j;
+	qnx_file fd;
+
+	for(;;)
 	{
-		if(!de.fname[0]) continue;
-		if(qnx_de2fd(dfd->qd,&de,&fd))
+		pthread_mutex_lock(&p->m);
+		while(!p->qn && !p->done)
+			pthread_cond_wait(&p->notempty,&p->m);
+		if(!p->qn)
 		{
-			func_msg("unable to open qnx file %s",de.fname);
-			continue;
+			pthread_mutex_unlock(&p->m);
+			break;
 		}
-		if(fd.attrs & QFA_DIRECTORY)
-		{
-			/* sanity check - in case of disk image corruption */
-			if(strlen((char *)de.fname)>QNX_MAXFNLEN)
-			{
-				func_msg("filename %s longer than expected",de.fname);
-				continue;
-			}
+		j=p->q[p->qh];
+		p->qh=(p->qh+1)%XQ_LEN;
+		p->qn--;
+		pthread_cond_signal(&p->notfull);
+		pthread_mutex_unlock(&p->m);
 
-			/* create new path and directory */
-			dpl=strlen(dpath);
-			npath=malloc(dpl+strlen((char *)de.fname)+2);
-			strcpy(npath,dpath);
-			if(dpl && dpath[dpl-1]!='/')
-				strcat(npath,"/");
-			strcat(npath,(char *)de.fname);
-			if(mkdir(npath,0755))
-			{
-				func_msg("can't create directory %s",npath);
-				free(npath);
-				continue;
-			}
-			
-			/* process it and then free npath */
-			extract_qnxdir(&fd,npath,optrs);
-			free(npath);
-		}
+		if(q_open_de(p->qd,&j.de,j.ei,&fd))
+			func_msg("unable to open qnx file %s",j.de.fname);
 		else
 		{
-			extract_qnxfile(&fd,(char *)de.fname,dpath,optrs);
+			extract_qnxfile(&fd,(char *)j.de.fname,j.dpath,p->optrs);
+			qnx_close(&fd);
 		}
+		free(j.dpath);
 	}
+	qstream_free();
+	return NULL;
+}
+
+int xpool_start(xpool *p, qnx_disk *qd, int nth, int optrs)
+{
+	int i;
 
+	memset(p,0,sizeof(xpool));
+	p->qd=qd;
+	p->optrs=optrs;
+	pthread_mutex_init(&p->m,NULL);
+	pthread_cond_init(&p->notempty,NULL);
+	pthread_cond_init(&p->notfull,NULL);
+	for(i=0;i<nth;i++)
+	{
+		if(pthread_create(&p->th[i],NULL,xpool_worker,p))
+			break;
+		p->nth++;
+	}
+	if(!p->nth)
+		func_abort("unable to start worker threads");
 	return 0;
 }
 
+/* queue extraction of de into dpath (blocks while queue is full) */
+int xpool_add(xpool *p, struct q_dir_entry *de, uint32_t ei, char *dpath)
+{
+	char *dp=strdup(dpath);
+	int i;
+
+	if(dp==NULL)
+		func_abort("alloc error!");
+	pthread_mutex_lock(&p->m);
+	while(p->qn==XQ_LEN)
+		pthread_cond_wait(&p->notfull,&p->m);
+	i=(p->qh+p->qn)%XQ_LEN;
+	memcpy(&p->q[i].de,de,sizeof(struct q_dir_entry));
+	p->q[i].ei=ei;
+	p->q[i].dpath=dp;
+	p->qn++;
+	pthread_cond_signal(&p->notempty);
+	pthread_mutex_unlock(&p->m);
+	return 0;
+}
 
-/* general */
-void exit_usage(char *pn, int rv)
+/* wait for queued jobs to finish and stop workers */
+void xpool_finish(xpool *p)
 {
-	printf("Usage: %s <disk_image> {-d|-x|-r} path [-a] [-o offset] [-l local_path]\n",pn);
-	printf("\t-d\tlist directory at path (must be directory)\n");
-	printf("\t-x\textract file (or directory contents, recursive) from path\n");
-	printf("\t-r\tread (dump) file to stdout\n");
-	printf("\t-a\tASCII file (convert RS to LF)\n");
-	printf("\t-o\tOffset (in bytes) into image file (e.g. for partition)\n");
-	printf("\t-l\tLocal destination for -x (file(s) extracted to local_path)\n");
-	printf("\nNotes:\n\t if multiple -r/d/x options are given, only last one is used\n");
-	printf("\t option -a affects all files (binary ones would be mangled!)\n");
-	exit(rv);
+	int i;
+
+	pthread_mutex_lock(&p->m);
+	p->done=1;
+	pthread_cond_broadcast(&p->notempty);
+	pthread_mutex_unlock(&p->m);
+	for(i=0;i<p->nth;i++)
+		pthread_join(p->th[i],NULL);
+	pthread_mutex_destroy(&p->m);
+	pthread_cond_destroy(&p->notempty);
+	pthread_cond_destroy(&p->notfull);
 }
 
-int main(int argc, char *argv[])
+/* io_uring extraction (-U): a single thread keeps up to XR_DEPTH extent
+ * reads and output writes in flight, over up to XR_FILES files; files are
+ * finished in whatever order their I/O completes. only binary files of
+ * plain images go through it (a mapped image is written out directly,
+ * without reads) */
+typedef struct xrfile
+{
+	qnx_file fd;
+	int ofd;		/* -1 - free slot */
+	uint32_t xi;	/* next extent to issue (fd.xmap index) */
+	uint32_t xoff;	/* ...and offset into it */
+	uint32_t foff;	/* file offset of the next chunk */
+	uint32_t nop;	/* operations in flight */
+	int err;
+	uint8_t name[QNX_MAXFNLEN+1];
+} xrfile;
+
+typedef struct xrop
 {
-	const char optstr[]="ar:d:x:o:l:";
+	int f;			/* xrfile index, -1 - free */
+	int wr;			/* 0 - reading from image, 1 - writing output */
+	const uint8_t *src;	/* data to write (buf, or the mapped image) */
+	uint8_t *buf;	/* XR_CHUNK bytes */
+	uint64_t ioff;	/* image offset (absolute) */
+	uint32_t foff;	/* output offset */
+	uint32_t len;
+	uint32_t pos;	/* bytes done (short reads/writes are continued) */
+} xrop;
 
-	char *dpath=NULL;
-	char *spath=NULL;
-	int or,e=0;
-	int op=0;
-	int rv=0;
+typedef struct xring
+{
+	qnx_disk *qd;
+	qd_uring r;
+	xrfile f[XR_FILES];
+	xrop op[XR_DEPTH];
+	uint8_t *bufs;
+	int nf;			/* files in use */
+	int next;		/* file to issue from next (round robin) */
+} xring;
 
-	int oflags=0;
-	int ioff=0;
+static xring *xr=NULL;	/* NULL - no io_uring extraction */
 
-	qnx_disk qd;
-	qnx_file qfd;
+/* 0 if ready, -1 if io_uring can't (or shouldn't) be used */
+int xring_start(xring *x, qnx_disk *qd, int optrs)
+{
+	int i;
 
-	while((or=getopt(argc,argv,optstr))!=-1)
+	if(optrs || (qd->oflags & QDO_NORAW))
 	{
-		switch(or)
-		{
-			case 'a':
-				oflags |= OPT_ASCII;
-				break;
-			case 'd':
-				op=OP_DIR;
-				spath=optarg;
-				break;
-			case 'r':
-				op=OP_DUMP;
-				spath=optarg;
-				break;
-			case 'x':
-				op=OP_EXTRACT;
-				spath=optarg;
-				break;
-			case 'o':
-				ioff=atoi(optarg);
-				break;
-			case 'l':
-				dpath=optarg;
-				break;
-			case '?':
-				e=1;
-				break;
-			default:
-				printf("Unrecognized option\n");
-				e=1;
-				break;
-		}
+		fprintf(stderr,"-U: converted files and compressed/IMD images are extracted synchronously\n");
+		return -1;
 	}
-	if(e || !op || optind>=argc)
-		exit_usage(argv[0],EXIT_FAILURE);
-
-	if(qd_open(&qd,argv[optind],ioff))
+	memset(x,0,sizeof(xring));
+	x->qd=qd;
+	if(qur_init(&x->r,XR_DEPTH))
 	{
-		fprintf(stderr,"Unable to open image file %s\n",argv[optind]);
-		return 1;
+		fprintf(stderr,"-U: io_uring not available (%s), extracting synchronously\n",strerror(errno));
+		return -1;
 	}
-	
-	if(q_open_file(&qd,spath,&qfd))
+	if(qd->map==NULL && (x->bufs=malloc((size_t)XR_DEPTH*XR_CHUNK))==NULL)
 	{
-		fprintf(stderr,"Unable to open %s inside image\n",spath);
-		rv=1;
-		goto eofunc;
+		qur_exit(&x->r);
+		func_abort("alloc error!");
+	}
+	for(i=0;i<XR_FILES;i++)
+		x->f[i].ofd=-1;
+	for(i=0;i<XR_DEPTH;i++)
+	{
+		x->op[i].f=-1;
+		x->op[i].buf=(x->bufs!=NULL) ? x->bufs+(size_t)i*XR_CHUNK : NULL;
 	}
+	return 0;
+}
 
-	switch(op)
+/* 1 if f has data left to issue (skips empty extents) */
+static int xrfile_more(xrfile *f)
+{
+	while(f->xi<f->fd.nxmap && f->xoff>=f->fd.xmap[f->xi].size)
 	{
-		case OP_EXTRACT:
-			if(qfd.attrs & QFA_DIRECTORY)
-				extract_qnxdir(&qfd,dpath,oflags & OPT_ASCII);
-			else
-				extract_qnxfile(&qfd,spath,dpath,oflags & OPT_ASCII);
-			break;
+		f->xi++;
+		f->xoff=0;
+	}
+	return !f->err && f->xi<f->fd.nxmap && f->foff<f->fd.fsize;
+}
+
+/* close file i if nothing is left to do for it */
+static void xring_filedone(xring *x, int i)
+{
+	xrfile *f=&x->f[i];
+
+	if(f->nop || xrfile_more(f))
+		return;
+	if(!f->err && f->foff<f->fd.fsize)
+		fprintf(stderr,"Copy finished early, %u bytes missing\n",f->fd.fsize-f->foff);
+	else if(f->err)
+		func_msg("Unable to extract %s",f->name);
+	close(f->ofd);
+	qnx_close(&f->fd);
+	f->ofd=-1;
+	x->nf--;
+}
+
+/* (re)submit what's left of operation i */
+static int xring_submit_op(xring *x, int i)
+{
+	xrop *o=&x->op[i];
+
+	if(o->wr)
+		return qur_write(&x->r,x->f[o->f].ofd,o->src+o->pos,o->len-o->pos,o->foff+o->pos,i);
+	return qur_read(&x->r,x->qd->fd,o->buf+o->pos,o->len-o->pos,o->ioff+o->pos,i);
+}
+
+/* start operations for the next chunks of the open files */
+static void xring_issue(xring *x)
+{
+	int i,j,k;
+	xrfile *f;
+	xrop *o;
+	qnx_xmap *m;
+
+	for(i=0;i<XR_DEPTH && x->nf;i++)
+	{
+		if(x->op[i].f!=-1)
+			continue;
+		for(j=0;j<XR_FILES;j++)
+		{
+			f=&x->f[k=(x->next+j)%XR_FILES];
+			if(f->ofd!=-1 && xrfile_more(f))
+				break;
+		}
+		if(j==XR_FILES)
+			return;		/* everything is in flight */
+		x->next=(k+1)%XR_FILES;
+
+		m=&f->fd.xmap[f->xi];
+		o=&x->op[i];
+		o->f=k;
+		o->len=MIN(MIN(m->size-f->xoff,f->fd.fsize-f->foff),XR_CHUNK);
+		o->pos=0;
+		o->ioff=x->qd->ioff+QBN2OFF(m->bn)+sizeof(struct q_xtnt_header)+f->xoff;
+		o->foff=f->foff;
+		o->wr=(x->qd->map!=NULL);
+		o->src=o->wr ? x->qd->map+o->ioff : o->buf;
+		qd_prefetch_used(x->qd,o->ioff-x->qd->ioff,o->len);
+		xring_submit_op(x,i);	/* can't fail, there are as many ring entries as ops */
+		f->xoff+=o->len;
+		f->foff+=o->len;
+		f->nop++;
+	}
+}
+
+/* operation i completed with res (bytes or -errno) */
+static void xring_complete(xring *x, int i, int32_t res)
+{
+	xrop *o=&x->op[i];
+	xrfile *f=&x->f[o->f];
+
+	if(res<=0)
+	{
+		if(!f->err)
+			fprintf(stderr,"%s error on %s: %s\n",o->wr ? "write" : "read",f->name,res ? strerror(-res) : "end of file");
+		f->err=1;
+	}
+	else if((o->pos+=res)<o->len)
+	{
+		xring_submit_op(x,i);
+		return;
+	}
+	else if(!o->wr)	/* data is in, write it */
+	{
+		o->wr=1;
+		o->pos=0;
+		xring_submit_op(x,i);
+		return;
+	}
+	f->nop--;
+	o->f=-1;
+	xring_filedone(x,f-x->f);
+}
+
+/* issue, submit and process completions (waiting for at least one if
+ * wait is set and something is in flight) */
+static int xring_step(xring *x, int wait)
+{
+	uint64_t d;
+	int32_t res;
+
+	xring_issue(x);
+	if(!x->r.inflight && !x->r.pending)
+		return 0;
+	if(qur_submit(&x->r,wait ? 1 : 0))
+		func_abort("io_uring error: %s",strerror(errno));
+	while(qur_cqe(&x->r,&d,&res))
+		xring_complete(x,d,res);
+	return 0;
+}
+
+/* open de and start extracting it into dpath (waits for a free file slot) */
+int xring_add(xring *x, struct q_dir_entry *de, uint32_t ei, char *dpath)
+{
+	xrfile *f;
+	int i;
+
+	while(x->nf==XR_FILES)
+		if(xring_step(x,1))
+			return -1;
+	for(i=0;x->f[i].ofd!=-1;i++);
+	f=&x->f[i];
+	if(q_open_de(x->qd,de,ei,&f->fd))
+		func_abort("unable to open qnx file %s",de->fname);
+	if((f->fd.xmap==NULL && qnx_build_xmap(&f->fd)) || (f->ofd=q_create_local((char *)de->fname,dpath))<0)
+	{
+		qnx_close(&f->fd);
+		f->ofd=-1;
+		return -1;
+	}
+	f->xi=f->xoff=f->foff=f->nop=0;
+	f->err=0;
+	memcpy(f->name,de->fname,QNX_MAXFNLEN);
+	f->name[QNX_MAXFNLEN]=0;
+	x->nf++;
+	xring_filedone(x,i);	/* empty file */
+	return xring_step(x,0);
+}
+
+/* wait for all files to be written, release the ring */
+void xring_finish(xring *x)
+{
+	int i;
+
+	while(x->nf)
+		if(xring_step(x,1))
+			break;
+	/* after an error reads and writes may still be in flight; the kernel
+	 * owns their buffers (and fds) until they complete */
+	if(qur_drain(&x->r))
+	{
+		func_msg("can't wait for pending I/O, leaving its buffers alone");
+		return;
+	}
+	qur_exit(&x->r);
+	for(i=0;i<XR_FILES;i++)
+		if(x->f[i].ofd!=-1)
+		{
+			close(x->f[i].ofd);
+			qnx_close(&x->f[i].fd);
+		}
+	free(x->bufs);
+}
+
+/* create directory fname under dpath, returns its (malloc'd) path or NULL */
+char *q_mkdir_sub(char *dpath, uint8_t *fname)
+{
+	char *npath;
+	size_t dpl;
+
+	/* sanity check - in case of disk image corruption */
+	if(strnlen((char *)fname,QNX_MAXFNLEN+1)>QNX_MAXFNLEN)
+	{
+		func_msg("filename %.*s longer than expected",QNX_MAXFNLEN+1,fname);
+		return NULL;
+	}
+
+	dpl=strlen(dpath);
+	npath=malloc(dpl+strlen((char *)fname)+2);
+	if(npath==NULL)
+		return NULL;
+	strcpy(npath,dpath);
+	if(dpl && dpath[dpl-1]!='/')
+		strcat(npath,"/");
+	strcat(npath,(char *)fname);
+	if(mkdir(npath,0755))
+	{
+		func_msg("can't create directory %s",npath);
+		free(npath);
+		return NULL;
+	}
+	return npath;
+}
+
+int extract_qnxdir(qnx_file *dfd, char *dpath, int optrs)
+{
+	qnx_file fd;
+	struct q_dir_entry *de;
+	qnx_diter it;
+	char *npath;
+
+	if(qnx_diter_init(&it,dfd))
+		return -1;
+	it.pfent=1;
+
+	while((de=qnx_diter_next(&it))!=NULL)
+	{
+		if(xr!=NULL && !(de->fattr & QFA_DIRECTORY))
+		{
+			xring_add(xr,de,QI_NONE,dpath);
+			continue;
+		}
+		if(xp!=NULL && !(de->fattr & QFA_DIRECTORY))
+		{
+			xpool_add(xp,de,QI_NONE,dpath);
+			continue;
+		}
+		if(qnx_de2fd(dfd->qd,de,&fd))
+		{
+			func_msg("unable to open qnx file %s",de->fname);
+			continue;
+		}
+		if(fd.attrs & QFA_DIRECTORY)
+		{
+			/* create new path and directory, process it and then free npath */
+			if((npath=q_mkdir_sub(dpath,de->fname))!=NULL)
+			{
+				extract_qnxdir(&fd,npath,optrs);
+				free(npath);
+			}
+		}
+		else
+		{
+			extract_qnxfile(&fd,(char *)de->fname,dpath,optrs);
+		}
+		qnx_close(&fd);
+	}
+	qnx_diter_close(&it);
+
+	return 0;
+}
+
+/* same as extract_qnxdir, walking the index instead of the image */
+int extract_qidir(qnx_disk *qd, uint32_t di, char *dpath, int optrs)
+{
+	const struct qi_entry *e=&xqi->ent[di];
+	struct q_dir_entry de;
+	qnx_file fd;
+	uint32_t i;
+	char *npath;
+
+	for(i=e->child;i<e->child+e->nchild;i++)
+	{
+		memcpy(&de,&xqi->ent[i].de,sizeof(struct q_dir_entry));
+		if(de.fattr & QFA_DIRECTORY)
+		{
+			if((npath=q_mkdir_sub(dpath,de.fname))!=NULL)
+			{
+				extract_qidir(qd,i,npath,optrs);
+				free(npath);
+			}
+		}
+		else if(xr!=NULL)
+			xring_add(xr,&de,i,dpath);
+		else if(xp!=NULL)
+			xpool_add(xp,&de,i,dpath);
+		else if(qi_open_file(xqi,qd,i,&fd))
+			func_msg("unable to open qnx file %s",de.fname);
+		else
+		{
+			extract_qnxfile(&fd,(char *)de.fname,dpath,optrs);
+			qnx_close(&fd);
+		}
+	}
+	return 0;
+}
+
+
+/* tar (ustar) output: the tree is written to stdout as an archive, through
+ * one large buffer (file data is read straight into it) */
+#define TAR_BLOCK 512
+
+typedef struct tarw
+{
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t cap;		/* multiple of TAR_BLOCK */
+	int used;			/* something was written (end marker needed) */
+	int err;
+} tarw;
+
+static tarw tw;
+
+static int tar_flush(void)
+{
+	if(tw.len && !tw.err && write_all(STDOUT_FILENO,tw.buf,tw.len))
+	{
+		fprintf(stderr,"tar: write error\n");
+		tw.err=1;
+	}
+	tw.len=0;
+	return tw.err ? -1 : 0;
+}
+
+/* free space in buffer (at least one block, flushing if needed) */
+static uint8_t *tar_space(uint32_t *n)
+{
+	if(tw.buf==NULL)
+	{
+		tw.cap=MAX(xbufsize-xbufsize%TAR_BLOCK,TAR_BLOCK);
+		if((tw.buf=malloc(tw.cap))==NULL)
+		{
+			tw.err=1;
+			return NULL;
+		}
+	}
+	if(tw.cap-tw.len<TAR_BLOCK && tar_flush())
+		return NULL;
+	*n=tw.cap-tw.len;
+	return tw.buf+tw.len;
+}
+
+/* pad to a block boundary (buffer is block aligned, so is len afterwards) */
+static void tar_pad(void)
+{
+	uint32_t p=(TAR_BLOCK-tw.len%TAR_BLOCK)%TAR_BLOCK;
+	memset(tw.buf+tw.len,0,p);
+	tw.len+=p;
+}
+
+/* append pax record "key=val" (its length counts its own digits) to *buf */
+static int tar_paxrec(char **buf, uint32_t *len, const char *key, const char *val)
+{
+	uint32_t l=strlen(key)+strlen(val)+3,d,p;
+	char *nb;
+
+	for(d=1,p=10;l+d>=p;d++,p*=10);
+	l+=d;
+	if((nb=realloc(*buf,*len+l+1))==NULL)
+		return -1;
+	snprintf(nb+*len,l+1,"%u %s=%s\n",l,key,val);
+	*buf=nb;
+	*len+=l;
+	return 0;
+}
+
+/* zero padded octal number, l-1 digits plus NUL */
+static void tar_octal(char *f, size_t l, uint64_t v)
+{
+	f[--l]=0;
+	while(l--)
+	{
+		f[l]='0'+(v&7);
+		v>>=3;
+	}
+}
+
+/* raw bytes into the archive (not padded) */
+static int tar_put(const void *src, uint32_t l)
+{
+	const uint8_t *b=(const uint8_t *)src;
+	uint8_t *p;
+	uint32_t n;
+
+	while(l)
+	{
+		if((p=tar_space(&n))==NULL)
+			return -1;
+		n=MIN(n,l);
+		memcpy(p,b,n);
+		tw.len+=n;
+		b+=n;
+		l-=n;
+	}
+	return 0;
+}
+
+/* ustar header block for name. the layout of the QNX permission bytes
+ * isn't documented here, so the mode is a plain 0644 (0755 directories)
+ * and fperms/fgperms go unchanged into a pax extended header, as a
+ * "comment" record (which readers ignore) "QNX fperms=0x.. fgperms=0x..",
+ * together with the full path if it doesn't fit the ustar name/prefix.
+ * de NULL - defaults (0755 directory, time 0, no pax header) */
+static int tar_header(const char *name, struct q_dir_entry *de, uint32_t size, char type)
+{
+	uint8_t *h;
+	char *pax=NULL,v[40];
+	size_t nl=strlen(name),pl=0;
+	uint32_t n,i,sum=0,paxl=0;
+	int longname=0;
+
+	if(nl>100)
+	{
+		/* split at a '/' so that the rest fits in name */
+		for(pl=nl-100;pl<nl && pl<=155 && name[pl]!='/';pl++);
+		if(pl>155 || pl>=nl || nl-pl-1>100)
+			longname=1;
+	}
+	if(longname && tar_paxrec(&pax,&paxl,"path",name))
+	{
+		free(pax);
+		return -1;
+	}
+	if(de!=NULL)
+	{
+		snprintf(v,sizeof(v),"QNX fperms=0x%02x fgperms=0x%02x",de->fperms,de->fgperms);
+		if(tar_paxrec(&pax,&paxl,"comment",v))
+		{
+			free(pax);
+			return -1;
+		}
+	}
+	if(paxl)
+	{
+		if(tar_header("././@PaxHeader",NULL,paxl,'x') || tar_put(pax,paxl))
+		{
+			free(pax);
+			return -1;
+		}
+		free(pax);
+		tar_pad();
+	}
+	if(longname)
+	{
+		name+=nl-99;	/* whatever fits, for old readers */
+		nl=99;
+		pl=0;
+	}
+
+	if((h=tar_space(&n))==NULL)
+		return -1;
+	memset(h,0,TAR_BLOCK);
+	if(pl)
+	{
+		memcpy(h+345,name,pl);		/* prefix */
+		memcpy(h,name+pl+1,nl-pl-1);
+	}
+	else
+		memcpy(h,name,nl);
+	tar_octal((char *)h+100,8,(de && !(de->fattr & QFA_DIRECTORY)) ? 0644 : 0755);
+	tar_octal((char *)h+108,8,de ? de->fowner : 0);
+	tar_octal((char *)h+116,8,de ? de->fgroup : 0);
+	tar_octal((char *)h+124,12,size);
+	tar_octal((char *)h+136,12,(de && de->fseconds>0) ? de->fseconds : 0);
+	h[156]=type;
+	memcpy(h+257,"ustar",6);
+	memcpy(h+263,"00",2);
+	memset(h+148,' ',8);
+	for(i=0;i<TAR_BLOCK;i++)
+		sum+=h[i];
+	tar_octal((char *)h+148,7,sum);
+	tw.len+=TAR_BLOCK;
+	tw.used=1;
+	return 0;
+}
+
+/* file data, read straight into the output buffer */
+static int tar_data(qnx_file *fd, int optrs)
+{
+	uint32_t rb=fd->fsize,n;
+	int32_t br;
+	uint8_t *p;
+
+	while(rb)
+	{
+		if((p=tar_space(&n))==NULL)
+			return -1;
+		if((br=q_read_conv(fd,p,MIN(n,rb),optrs))<=0)
+			break;
+		tw.len+=br;
+		rb-=br;
+	}
+	if(rb)
+	{
+		/* keep the archive consistent: the header promised fsize bytes */
+		fprintf(stderr,"tar: short read, %u bytes zero filled\n",rb);
+		while(rb)
+		{
+			if((p=tar_space(&n))==NULL)
+				return -1;
+			n=MIN(n,rb);
+			memset(p,0,n);
+			tw.len+=n;
+			rb-=n;
+		}
+	}
+	tar_pad();
+	return tw.err ? -1 : 0;
+}
+
+/* file (or directory, recursively) fd, entry de, as name in the archive */
+int tar_qnxfile(qnx_file *fd, struct q_dir_entry *de, char *name, int optrs)
+{
+	qnx_file cfd;
+	qnx_diter it;
+	struct q_dir_entry *cde;
+	char *cname;
+	size_t nl=strlen(name);
+
+	if(!(fd->attrs & QFA_DIRECTORY))
+	{
+		if(tar_header(name,de,fd->fsize,'0'))
+			return -1;
+		return tar_data(fd,optrs);
+	}
+
+	if(nl && tar_header(name,de,0,'5'))
+		return -1;
+	if(qnx_diter_init(&it,fd))
+		return -1;
+	it.pfent=1;
+	if((cname=malloc(nl+QNX_MAXFNLEN+3))==NULL)
+	{
+		qnx_diter_close(&it);
+		func_abort("alloc error!");
+	}
+	while((cde=qnx_diter_next(&it))!=NULL && !tw.err)
+	{
+		if(strnlen((char *)cde->fname,QNX_MAXFNLEN+1)>QNX_MAXFNLEN)
+		{
+			func_msg("filename %.*s longer than expected",QNX_MAXFNLEN+1,cde->fname);
+			continue;
+		}
+		sprintf(cname,"%s%s%s",name,(char *)cde->fname,(cde->fattr & QFA_DIRECTORY) ? "/" : "");
+		if(qnx_de2fd(fd->qd,cde,&cfd))
+		{
+			func_msg("unable to open qnx file %s",cde->fname);
+			continue;
+		}
+		tar_qnxfile(&cfd,cde,cname,optrs);
+		qnx_close(&cfd);
+	}
+	free(cname);
+	qnx_diter_close(&it);
+	return tw.err ? -1 : 0;
+}
+
+/* end of archive (two zero blocks), if anything was written */
+int tar_finish(void)
+{
+	uint8_t *p;
+	uint32_t n,i;
+	int err;
+
+	if(!tw.used)
+		return 0;
+	for(i=0;i<2;i++)
+	{
+		if((p=tar_space(&n))==NULL)
+			break;
+		memset(p,0,TAR_BLOCK);
+		tw.len+=TAR_BLOCK;
+	}
+	tar_flush();
+	err=tw.err;
+	free(tw.buf);
+	memset(&tw,0,sizeof(tw));
+	return err ? -1 : 0;
+}
+
+/* directory entry of path (for the header of the top entry of -t) */
+int q_stat_path(qnx_disk *qd, char *spath, uint32_t ei, struct q_dir_entry *de)
+{
+	qnx_file pfd;
+	char *pp,*bn;
+	int r;
+
+	if(ei!=QI_NONE)
+	{
+		memcpy(de,&xqi->ent[ei].de,sizeof(struct q_dir_entry));
+		return 0;
+	}
+	if((pp=strdup(spath))==NULL)
+		return -1;
+	while((bn=strrchr(pp,'/'))!=NULL && !bn[1] && bn!=pp)
+		*bn=0;	/* trailing slashes */
+	if(bn==NULL || !bn[1])
+	{
+		free(pp);
+		return -1;	/* root has no entry of its own (except in the superblock) */
+	}
+	*bn++=0;
+	r=q_open_file(qd,pp[0] ? pp : "/",&pfd);
+	if(!r)
+	{
+		r=qnx_lookup(&pfd,bn,de);
+		qnx_close(&pfd);
+	}
+	free(pp);
+	return r ? -1 : 0;
+}
+
+
+/* general */
+void exit_usage(char *pn, int rv)
+{
+	printf("Usage: %s <disk_image> {-d|-x|-r|-t} path ... [-b batch_file] [-s] [-a] [-m] [-P] [-2] [-z] [-c slots] [-j threads | -U] [-M kbytes] [-I index] [-o offset | -p {n|all|list}] [-l local_path]\n",pn);
+	printf("\t-d\tlist directory at path (must be directory)\n");
+	printf("\t-x\textract file (or directory contents, recursive) from path\n");
+	printf("\t-r\tread (dump) file to stdout\n");
+	printf("\t-t\twrite file or directory (recursive) to stdout as a tar archive,\n\t\tnames prefixed by local_path (-l) if given\n");
+	printf("\t-b\trun commands ({-d|-x|-r|-t} path [-a] [-l local_path], one per line)\n\t\tfrom batch_file (- for stdin)\n");
+	printf("\t-s\tscan whole image for files not reachable from root (deleted/lost),\n\t\tlist them and, with -l, extract them as local_path/orphan_<block>\n");
+	printf("\t-a\tASCII file (convert RS to LF)\n");
+	printf("\t-m\tmemory-map image file instead of reading it sector by sector\n");
+	printf("\t-P\tprefetch: ask the OS to read ahead extents and directory entries'\n\t\tfirst extents before they are needed (counters on stderr)\n");
+	printf("\t-2\tQNX 2.x image (take file sizes from directory entries)\n");
+	printf("\t-z\tsave (and reuse) the seek index of a compressed image in <disk_image>.gzi\n");
+	printf("\t-c\tsector cache size in %d byte slots (default %d, max %d, 0 disables)\n",Q_BLOCKSIZE,DEF_CACHE_SLOTS,QC_MAXSLOTS);
+	printf("\t-j\textract using this many worker threads (max %d)\n",MAX_JOBS);
+	printf("\t-U\textract directories with io_uring: many reads and writes in flight\n\t\tfrom one thread (binary files of plain images; falls back to -j\n\t\tor sequential extraction if io_uring is not available)\n");
+	printf("\t-M\tmemory for file copy buffers, per thread (KB, default %d)\n",DEF_XBUF_KB);
+	printf("\t-I\tuse (and create or refresh if needed) index file for the image\n");
+	printf("\t-o\tOffset (in bytes) into image file (e.g. for partition)\n");
+	printf("\t-p\tuse partition n (1-4 primary, 5+ logical) of a partitioned disk image,\n\t\tall QNX partitions (local paths and index get a pN suffix)\n\t\tor list the partition table\n");
+	printf("\t-l\tLocal destination for -x (file(s) extracted to local_path)\n");
+	printf("\nNotes:\n\t multiple -r/d/x/t options are run in order, after the batch file\n");
+	printf("\t all -t options make one archive (don't mix -t with other output)\n");
+	printf("\t option -a affects all files (binary ones would be mangled!)\n");
+	printf("\t without -o/-p, a partitioned image is opened at its first QNX partition\n");
+	printf("\t gzip/zlib compressed images are read directly (the whole image is\n\t decompressed once to build a seek index, see -z)\n");
+	printf("\t ImageDisk (IMD) images are read directly\n");
+	exit(rv);
+}
+
+/* command line options, shared by all partitions */
+typedef struct qopts
+{
+	int oflags;
+	int cslots;
+	int njobs;
+	int nops;
+	int ops[MAX_OPS];
+	char *spaths[MAX_OPS];
+	char *dpath;
+	char *ipath;
+	char *bpath;
+} qopts;
+
+/* archive spath (file or tree) as tar to stdout; names are relative to
+ * the parent of spath, prefixed by dpath (if given) */
+int run_tar(qnx_disk *qd, qnx_file *qfd, char *spath, char *dpath, uint32_t ei, int optrs)
+{
+	struct q_dir_entry de;
+	char *name,*bn;
+	int has_de,r;
+
+	has_de=!q_stat_path(qd,spath,ei,&de);
+	bn=has_de ? (char *)de.fname : (char *)"";
+	if(asprintf(&name,"%s%s%.*s%s",dpath ? dpath : "",(dpath && dpath[0] && dpath[strlen(dpath)-1]!='/') ? "/" : "",
+		QNX_MAXFNLEN+1,bn,(has_de && (qfd->attrs & QFA_DIRECTORY)) ? "/" : "")<0)
+		return -1;
+	r=tar_qnxfile(qfd,has_de ? &de : NULL,name,optrs);
+	free(name);
+	return r;
+}
+
+/* execute one -d/-r/-x/-t operation on the already opened image */
+int run_op(qnx_disk *qd, int op, char *spath, char *dpath, int optrs, int njobs)
+{
+	qnx_file qfd;
+	xpool pool;
+	xring ring;
+	uint32_t ei=QI_NONE;
+	int rv=0;
+
+	if(xqi!=NULL && (ei=qi_lookup(xqi,spath))==QI_NONE)
+	{
+		fprintf(stderr,"%s not found in index\n",spath);
+		return 1;
+	}
+	if(xqi!=NULL ? qi_open_file(xqi,qd,ei,&qfd) : q_open_file(qd,spath,&qfd))
+	{
+		fprintf(stderr,"Unable to open %s inside image\n",spath);
+		return 1;
+	}
+
+	switch(op)
+	{
+		case OP_EXTRACT:
+			if(qfd.attrs & QFA_DIRECTORY)
+			{
+				if(xuring && !xring_start(&ring,qd,optrs))
+					xr=&ring;
+				else if(njobs>1 && !xpool_start(&pool,qd,njobs,optrs))
+					xp=&pool;
+				if(ei!=QI_NONE)
+					extract_qidir(qd,ei,dpath ? dpath : "",optrs);
+				else
+					extract_qnxdir(&qfd,dpath ? dpath : "",optrs);
+				if(xr!=NULL)
+					xring_finish(xr);
+				if(xp!=NULL)
+					xpool_finish(xp);
+				xp=NULL;
+				xr=NULL;
+			}
+			else
+				extract_qnxfile(&qfd,spath,dpath,optrs);
+			break;
 		case OP_DIR:
 			if(qfd.attrs & QFA_DIRECTORY)
-				disp_qnxdir(&qfd);
+			{
+				if(ei!=QI_NONE)
+					disp_qidir(ei);
+				else
+					disp_qnxdir(&qfd);
+			}
 			else
 				fprintf(stderr,"%s is not a directory\n",spath);
 			break;
@@ -361,11 +1503,483 @@ int main(int argc, char *argv[])
 				rv=1;
 			}
 			else
-				disp_qnxfile(&qfd,oflags & OPT_ASCII);
+				disp_qnxfile(&qfd,optrs);
+			break;
+		case OP_TAR:
+			rv=run_tar(qd,&qfd,spath,dpath,ei,optrs) ? 1 : 0;
 			break;
 	}
+	qnx_close(&qfd);
+	fflush(stdout);
+	return rv;
+}
+
+/* batch mode: one command per line, with the same syntax as on the command
+ * line: {-d|-r|-x|-t} path [-a] [-l local_path] (empty lines and # comments are
+ * ignored). all commands share the open image, its caches and index */
+int run_batch(qnx_disk *qd, char *bpath, int njobs)
+{
+	FILE *f;
+	char line[4096];
+	char *tok[16];
+	char *sp,*arg;
+	char *spath,*dpath;
+	int nt,i,c,e;
+	int op,optrs;
+	int ln=0,rv=0;
+
+	if(strcmp(bpath,"-")==0)
+		f=stdin;
+	else if((f=fopen(bpath,"r"))==NULL)
+	{
+		fprintf(stderr,"Unable to open batch file %s\n",bpath);
+		return 1;
+	}
+
+	while(fgets(line,sizeof(line),f)!=NULL)
+	{
+		ln++;
+		nt=0;
+		for(arg=strtok_r(line," \t\r\n",&sp);arg!=NULL && nt<16;arg=strtok_r(NULL," \t\r\n",&sp))
+			tok[nt++]=arg;
+		if(!nt || tok[0][0]=='#')
+			continue;
+
+		op=optrs=e=0;
+		spath=dpath=NULL;
+		for(i=0;i<nt;i++)
+		{
+			c=(tok[i][0]=='-') ? tok[i][1] : 0;
+			if(c=='a' && !tok[i][2])
+			{
+				optrs=OPT_ASCII;
+				continue;
+			}
+			if(c!='d' && c!='r' && c!='x' && c!='t' && c!='l')
+			{
+				e=1;
+				break;
+			}
+			/* option argument, attached or separate (like getopt) */
+			if(tok[i][2])
+				arg=tok[i]+2;
+			else if(i+1<nt)
+				arg=tok[++i];
+			else
+			{
+				e=1;
+				break;
+			}
+			if(c=='l')
+				dpath=arg;
+			else
+			{
+				op=(c=='d') ? OP_DIR : (c=='r') ? OP_DUMP : (c=='t') ? OP_TAR : OP_EXTRACT;
+				spath=arg;
+			}
+		}
+		if(e || !op)
+		{
+			fprintf(stderr,"%s:%d: bad command\n",bpath,ln);
+			rv=1;
+			continue;
+		}
+		if(run_op(qd,op,spath,dpath,optrs,njobs))
+			rv=1;
+	}
+	if(f!=stdin)
+		fclose(f);
+	return rv;
+}
+
+/* write the data of scanned chain c to dpath/orphan_<first block> */
+int extract_chain(qnx_disk *qd, qnx_scan *s, qs_chain *c, char *dpath)
+{
+	qstream *qs;
+	qs_xtnt *x;
+	char *dfn;
+	uint32_t i,xi,l,off;
+	int ofd,rv=0;
+
+	if((qs=qstream_get())==NULL)
+		func_abort("can't allocate stream buffers");
+	x=s->x+c->first;
+	if(asprintf(&dfn,"%s%sorphan_%u",dpath,(dpath[0] && dpath[strlen(dpath)-1]!='/') ? "/" : "",x->bn)<0)
+		func_abort("alloc error!");
+	if((ofd=open(dfn,O_CREAT | O_EXCL | O_WRONLY,0644))<0)
+	{
+		fprintf(stderr,"Unable to open or create %s\n",dfn);
+		free(dfn);
+		return -1;
+	}
+	printf("%s\n",dfn);
+	for(i=0,xi=c->first;i<c->nx && !rv;i++,xi=s->x[xi].next)
+	{
+		x=s->x+xi;
+		for(off=0;off<x->h.size_xtnt && !rv;off+=l)
+		{
+			l=MIN(x->h.size_xtnt-off,qs->bsize);
+			if(qd_read(qd,qs->buf[0],QBN2OFF(x->bn)+sizeof(struct q_xtnt_header)+off,l) ||
+				write_all(ofd,qs->buf[0],l))
+				rv=-1;
+		}
+	}
+	if(rv)
+		fprintf(stderr,"Unable to extract %s\n",dfn);
+	close(ofd);
+	free(dfn);
+	return rv;
+}
+
+/* scan the whole image for extent chains not reachable from the root
+ * directory (deleted or lost files); report them and, given a local path,
+ * extract them */
+int run_scan(qnx_disk *qd, char *dpath)
+{
+	qnx_scan s;
+	qs_chain *c;
+	uint32_t i,n=0,nx=0;
+	uint64_t sz=0;
+	int rv=0;
+
+	if(qs_scan(qd,&s,0))
+	{
+		fprintf(stderr,"Image scan failed\n");
+		return 1;
+	}
+	for(i=0;i<s.nc;i++)
+	{
+		c=s.c+i;
+		if(c->flags & QSC_REACH)
+			continue;
+		printf("orphan at %u: %u extent%s, %" PRIu64 " bytes%s%s%s\n",s.x[c->first].bn,c->nx,c->nx==1 ? "" : "s",c->size,
+			(c->flags & QSC_NOHEAD) ? ", start missing" : "",(c->flags & QSC_NOTAIL) ? ", end missing" : "",
+			(c->flags & QSC_CYCLE) ? ", loops" : "");
+		n++;
+		nx+=c->nx;
+		sz+=c->size;
+		if(dpath!=NULL && extract_chain(qd,&s,c,dpath))
+			rv=1;
+	}
+	printf("%u blocks scanned, %" PRIu64 " candidates, %u extents, %u orphan chains (%u extents, %" PRIu64 " bytes)\n",
+		s.nblocks,s.ncand,s.nx,n,nx,sz);
+	qs_free(&s);
+	fflush(stdout);
+	return rv;
+}
+
+int q_has_op(qopts *o, int op)
+{
+	int i;
+
+	for(i=0;i<o->nops;i++)
+		if(o->ops[i]==op)
+			return 1;
+	return 0;
+}
+
+/* a QNX filesystem at offset 0 has a directory as root */
+int q_root_ok(qnx_disk *qd)
+{
+	struct q_block1 sb;
+
+	if(qd->ioff+Q_BLOCKSIZE > qd->isize || qd_read(qd,&sb,0,sizeof(struct q_block1)))
+		return 0;
+	return (sb.root_dir.fattr & QFA_DIRECTORY) && sb.root_dir.ffirst_xtnt>0 &&
+		qd->ioff+QBN2OFF(sb.root_dir.ffirst_xtnt)+sizeof(struct q_xtnt_header) <= qd->isize;
+}
+
+/* run everything requested on one filesystem (partition); pnum>0 - one of
+ * several partitions: index and local paths get a pN suffix */
+int run_disk(qnx_disk *qd, qopts *o, int pnum)
+{
+	qnx_index qi;
+	qd_pfstat pf;
+	char *ipath=o->ipath;
+	char *dpath=o->dpath;
+	char *sfx=NULL;
+	int i,rv=0;
+
+	if(o->cslots>0 && qd_cache_init(qd,o->cslots))
+		fprintf(stderr,"Unable to allocate sector cache, continuing without it\n");
+	if(qd_dirhash_init(qd,DEF_DIRHASH))
+		fprintf(stderr,"Unable to allocate directory hash tables, continuing without them\n");
+
+	if(pnum>0)
+	{
+		if(asprintf(&sfx,"p%d",pnum)<0)
+			return 1;
+		if(ipath!=NULL && asprintf(&ipath,"%s.%s",o->ipath,sfx)<0)
+			ipath=NULL;
+		if(asprintf(&dpath,"%s%s%s",o->dpath ? o->dpath : "",
+			(o->dpath && o->dpath[0] && o->dpath[strlen(o->dpath)-1]!='/') ? "/" : "",sfx)<0)
+			dpath=NULL;
+		else if(!q_has_op(o,OP_TAR) && mkdir(dpath,0755) && errno!=EEXIST)	/* tar: name prefix only */
+			fprintf(stderr,"Unable to create %s\n",dpath);
+	}
+
+	if(ipath!=NULL)
+	{
+		if(qi_open_build(qd,&qi,ipath))
+			fprintf(stderr,"Unable to use index %s, continuing without it\n",ipath);
+		else
+			xqi=&qi;
+	}
+
+	if(o->bpath!=NULL)
+		rv=run_batch(qd,o->bpath,o->njobs);
+	for(i=0;i<o->nops;i++)
+		if(run_op(qd,o->ops[i],o->spaths[i],dpath,o->oflags & OPT_ASCII,o->njobs))
+			rv=1;
+	if((o->oflags & OPT_SCAN) && run_scan(qd,dpath))
+		rv=1;
+
+	if(xqi!=NULL)
+		qi_close(xqi);
+	xqi=NULL;
+	if(o->oflags & OPT_PREFETCH)
+	{
+		qd_prefetch_stats(qd,&pf);
+		fprintf(stderr,"prefetch: %" PRIu64 " requests (%" PRIu64 " KB), %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " unused\n",
+			pf.issued,pf.bytes/1024,pf.hits,pf.misses,pf.unused);
+	}
+	if(pnum>0)
+	{
+		if(ipath!=o->ipath)
+			free(ipath);
+		if(dpath!=o->dpath)
+			free(dpath);
+		free(sfx);
+	}
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	const char optstr[]="am2zsPUc:j:M:I:b:r:d:x:t:o:p:l:";
+
+	qopts o;
+	int or,e=0;
+	int i,n;
+	int rv=0;
+
+	uint64_t ioff=0,v;
+	int hasoff=0;
+	char *ep;
+	int pnum=0;		/* 0 - none, -1 - all QNX partitions, -2 - list */
+	qd_part parts[MAX_PARTS];
+	int nparts=0;
+
+	qnx_disk qd,pqd;
+
+	memset(&o,0,sizeof(o));
+	o.cslots=DEF_CACHE_SLOTS;
+
+	while((or=getopt(argc,argv,optstr))!=-1)
+	{
+		switch(or)
+		{
+			case 'a':
+				o.oflags |= OPT_ASCII;
+				break;
+			case 'm':
+				o.oflags |= OPT_MMAP;
+				break;
+			case '2':
+				o.oflags |= OPT_QNX2;
+				break;
+			case 'z':
+				o.oflags |= OPT_GZIDX;
+				break;
+			case 's':
+				o.oflags |= OPT_SCAN;
+				break;
+			case 'P':
+				o.oflags |= OPT_PREFETCH;
+				break;
+			case 'U':
+				xuring=1;
+				break;
+			case 'd':
+			case 'r':
+			case 'x':
+			case 't':
+				if(o.nops==MAX_OPS)
+				{
+					fprintf(stderr,"Too many -d/-r/-x/-t options (max %d)\n",MAX_OPS);
+					e=1;
+					break;
+				}
+				o.ops[o.nops]=(or=='d') ? OP_DIR : (or=='r') ? OP_DUMP : (or=='t') ? OP_TAR : OP_EXTRACT;
+				o.spaths[o.nops++]=optarg;
+				break;
+			case 'c':
+				if(q_strtonum(optarg,QC_MAXSLOTS,&v))
+				{
+					fprintf(stderr,"-c must be between 0 and %d\n",QC_MAXSLOTS);
+					e=1;
+				}
+				else
+					o.cslots=v;
+				break;
+			case 'j':
+				if(q_strtonum(optarg,MAX_JOBS,&v))
+				{
+					fprintf(stderr,"-j must be between 0 and %d\n",MAX_JOBS);
+					e=1;
+				}
+				else
+					o.njobs=v;
+				break;
+			case 'M':
+				if(q_strtonum(optarg,1024*1024,&v) || v<1)
+				{
+					fprintf(stderr,"-M must be between 1 and %d\n",1024*1024);
+					e=1;
+				}
+				else
+					xbufsize=v*1024;
+				break;
+			case 'I':
+				o.ipath=optarg;
+				break;
+			case 'b':
+				o.bpath=optarg;
+				break;
+			case 'o':
+				errno=0;
+				ioff=strtoull(optarg,&ep,10);
+				hasoff=1;
+				if(errno || ep==optarg || *ep || optarg[0]=='-')
+				{
+					fprintf(stderr,"Invalid offset %s\n",optarg);
+					e=1;
+				}
+				break;
+			case 'p':
+				if(strcmp(optarg,"all")==0)
+					pnum=-1;
+				else if(strcmp(optarg,"list")==0)
+					pnum=-2;
+				else if(q_strtonum(optarg,MAX_PARTS,&v) || (pnum=v)<1)
+				{
+					fprintf(stderr,"Invalid partition %s\n",optarg);
+					e=1;
+				}
+				break;
+			case 'l':
+				o.dpath=optarg;
+				break;
+			case '?':
+				e=1;
+				break;
+			default:
+				printf("Unrecognized option\n");
+				e=1;
+				break;
+		}
+	}
+	if(hasoff && pnum)
+	{
+		fprintf(stderr,"-o and -p are mutually exclusive\n");
+		e=1;
+	}
+	if(pnum==-1 && o.bpath!=NULL && strcmp(o.bpath,"-")==0)
+	{
+		fprintf(stderr,"-p all can't read the batch file from stdin\n");
+		e=1;
+	}
+	if(e || (!o.nops && o.bpath==NULL && pnum!=-2 && !(o.oflags & OPT_SCAN)) || optind>=argc)
+		exit_usage(argv[0],EXIT_FAILURE);
+
+	if(qd_open(&qd,argv[optind],ioff,((o.oflags & OPT_MMAP) ? QDO_MMAP : 0) | ((o.oflags & OPT_QNX2) ? QDO_QNX2 : 0) |
+		((o.oflags & OPT_GZIDX) ? QDO_GZIDX : 0) | ((o.oflags & OPT_PREFETCH) ? QDO_PREFETCH : 0)))
+	{
+		fprintf(stderr,"Unable to open image file %s\n",argv[optind]);
+		return 1;
+	}
+
+	/* partition selection; without -o/-p a disk with a partition table
+	 * (MBR signature) and no filesystem at offset 0 is opened at its first
+	 * QNX partition that has a usable root directory, saying so */
+	if(pnum || (!hasoff && !q_root_ok(&qd)))
+		nparts=qd_read_parts(&qd,parts,MAX_PARTS);
+	if(pnum==-2)
+	{
+		for(i=0;i<nparts;i++)
+			printf("%2d  type %02x%s  offset %" PRIu64 "  size %" PRIu64 "\n",parts[i].num,parts[i].type,
+				QD_ISQNXPART(parts[i].type) ? " (QNX)" : "",parts[i].start,parts[i].size);
+		qd_close(&qd);
+		return nparts ? 0 : 1;
+	}
+	if(!pnum && !hasoff && nparts)
+	{
+		for(i=0;i<nparts;i++)
+		{
+			if(!QD_ISQNXPART(parts[i].type) || !parts[i].start || parts[i].start>=qd.isize ||
+				qd_open_view(&pqd,&qd,parts[i].start,parts[i].size))
+				continue;
+			n=q_root_ok(&pqd);
+			qd_close(&pqd);
+			if(n)
+				break;
+		}
+		if(i<nparts)
+		{
+			fprintf(stderr,"%s: no filesystem at offset 0, using QNX partition %d at offset %" PRIu64 " (-o 0 to override)\n",
+				argv[optind],parts[i].num,parts[i].start);
+			pnum=parts[i].num;
+		}
+	}
+
+	if(pnum>0)
+	{
+		for(i=0;i<nparts && parts[i].num!=pnum;i++);
+		if(i==nparts)
+		{
+			fprintf(stderr,"No partition %d in %s\n",pnum,argv[optind]);
+			rv=1;
+		}
+		else if(qd_open_view(&pqd,&qd,parts[i].start,parts[i].size))
+			rv=1;
+		else
+		{
+			rv=run_disk(&pqd,&o,0);
+			qd_close(&pqd);
+		}
+	}
+	else if(pnum==-1)
+	{
+		for(i=n=0;i<nparts;i++)
+		{
+			if(!QD_ISQNXPART(parts[i].type))
+				continue;
+			n++;
+			/* stdout is the archive with -t */
+			fprintf(q_has_op(&o,OP_TAR) ? stderr : stdout,"=== partition %d (type %02x, offset %" PRIu64 ") ===\n",
+				parts[i].num,parts[i].type,parts[i].start);
+			fflush(stdout);
+			if(qd_open_view(&pqd,&qd,parts[i].start,parts[i].size))
+			{
+				rv=1;
+				continue;
+			}
+			if(run_disk(&pqd,&o,parts[i].num))
+				rv=1;
+			qd_close(&pqd);
+		}
+		if(!n)
+		{
+			fprintf(stderr,"No QNX partitions in %s\n",argv[optind]);
+			rv=1;
+		}
+	}
+	else
+		rv=run_disk(&qd,&o,0);
+	if(tar_finish())	/* one archive for all -t (and all partitions) */
+		rv=1;
+	qstream_free();
 
-eofunc:
 	qd_close(&qd);
 	return rv;
 }
@@ -0,0 +1,389 @@
+/* qfsck.c - QNX (1.2) filesystem consistency check
+ * uses qnx_acc library
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* All extent headers are found by one sequential pass over the image
+ * (qnx_scan). The tree is then walked using those headers only, so no
+ * extent chain is chased on disk: every block gets an owner (the first file
+ * claiming it), and links, loops and directory entry fields are checked
+ * along the way. Directory contents are the only other data read. */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include "qnx_acc.h"
+#include "qnx_scan.h"
+
+#define MAX_DEPTH 64
+#define MAX_PARTS 64
+
+typedef struct fsck
+{
+	qnx_disk *qd;
+	qnx_scan s;
+	uint32_t *owner;	/* per block: file id + 1, 0 = free */
+	uint32_t *walk;		/* per extent header: last chain walk that reached it */
+	uint32_t nwalk;		/* chain walks so far */
+	char **path;		/* by file id */
+	uint32_t npath,cpath;
+	int qnx2;			/* check sizes against fnum_blks/fnum_chars_free */
+	uint32_t nerr;
+	uint32_t nfiles,ndirs;
+	uint64_t nused;		/* owned blocks */
+} fsck;
+
+static void fsck_err(fsck *f, uint32_t id, const char *fmt, ...)
+{
+	va_list ap;
+
+	f->nerr++;
+	printf("%s: ",f->path[id]);
+	va_start(ap,fmt);
+	vprintf(fmt,ap);
+	va_end(ap);
+	printf("\n");
+}
+
+/* new file id for path (copied) */
+static uint32_t fsck_addpath(fsck *f, const char *dir, const uint8_t *name)
+{
+	char **np;
+	char *p;
+	size_t dl=strlen(dir);
+
+	if(f->npath==f->cpath)
+	{
+		f->cpath=f->cpath ? f->cpath*2 : 256;
+		if((np=realloc(f->path,f->cpath*sizeof(char *)))==NULL)
+			return QS_NONE;
+		f->path=np;
+	}
+	if((p=malloc(dl+QNX_MAXFNLEN+3))==NULL)
+		return QS_NONE;
+	sprintf(p,"%s%s%.*s",dir,(dl && dir[dl-1]!='/') ? "/" : "",QNX_MAXFNLEN+1,(const char *)name);
+	f->path[f->npath]=p;
+	return f->npath++;
+}
+
+/* claim blocks of extent x for file id, report blocks owned by another */
+static void fsck_own(fsck *f, uint32_t id, qs_xtnt *x)
+{
+	uint64_t b,end=(uint64_t)x->bn+MAX(x->h.bound_xtnt,1);
+	uint32_t other=0,n=0;
+
+	for(b=x->bn;b<end && b<=f->s.nblocks;b++)
+	{
+		if(!f->owner[b])
+		{
+			f->owner[b]=id+1;
+			f->nused++;
+		}
+		else if(f->owner[b]!=id+1)
+		{
+			other=f->owner[b];
+			n++;
+		}
+	}
+	if(n)
+		fsck_err(f,id,"extent %u: %u block%s cross-linked with %s",x->bn,n,n==1 ? "" : "s",f->path[other-1]);
+}
+
+static void fsck_file(fsck *f, struct q_dir_entry *de, uint32_t id, int depth);
+
+/* check the entries of directory id, given the indexes of its extents */
+static void fsck_dir(fsck *f, uint32_t id, uint32_t *xl, uint32_t nx, uint64_t size, int depth)
+{
+	uint8_t *buf,*p;
+	struct q_dir_entry de;
+	uint64_t off=0;
+	uint32_t i,cid;
+
+	if(size<sizeof(struct q_dir_cont))
+		return;
+	if((buf=malloc(size))==NULL)
+	{
+		fsck_err(f,id,"can't allocate %" PRIu64 " bytes for directory",size);
+		return;
+	}
+	for(i=0;i<nx;i++)
+	{
+		qs_xtnt *x=f->s.x+xl[i];
+		if(qd_read(f->qd,buf+off,QBN2OFF(x->bn)+sizeof(struct q_xtnt_header),x->h.size_xtnt))
+		{
+			fsck_err(f,id,"can't read extent %u",x->bn);
+			free(buf);
+			return;
+		}
+		off+=x->h.size_xtnt;
+	}
+	for(p=buf+sizeof(struct q_dir_cont);p+sizeof(struct q_dir_entry)<=buf+size;p+=sizeof(struct q_dir_entry))
+	{
+		memcpy(&de,p,sizeof(de));
+		if(!de.fname[0])
+			continue;
+		if((cid=fsck_addpath(f,f->path[id],de.fname))==QS_NONE)
+		{
+			fsck_err(f,id,"alloc error!");
+			break;
+		}
+		fsck_file(f,&de,cid,depth+1);
+	}
+	free(buf);
+}
+
+/* check file (or directory, recursively) with entry de */
+static void fsck_file(fsck *f, struct q_dir_entry *de, uint32_t id, int depth)
+{
+	qs_xtnt *x;
+	uint32_t *xl=NULL,*nxl;
+	uint32_t bn,prev=0,last=0,nx=0,cxl=0,i;
+	uint64_t size=0;
+	int64_t dsize;
+	int isdir=(de->fattr & QFA_DIRECTORY)!=0;
+	uint32_t shared;	/* owner of the first extent (+1), already walked */
+
+	if(isdir)
+		f->ndirs++;
+	else
+		f->nfiles++;
+	if(de->ffirst_xtnt<=0 || (uint32_t)de->ffirst_xtnt>f->s.nblocks)
+	{
+		fsck_err(f,id,"first extent %d outside image",de->ffirst_xtnt);
+		return;
+	}
+	/* cross-linked from the start: the chain is still walked (and each
+	 * shared extent reported by fsck_own), but not descended into again */
+	shared=f->owner[de->ffirst_xtnt];
+	f->nwalk++;	/* loops are found by this walk's own history, not ownership */
+
+	for(bn=de->ffirst_xtnt;bn;bn=x->h.next_xtnt)
+	{
+		if((i=qs_find(&f->s,bn))==QS_NONE)
+		{
+			fsck_err(f,id,"no valid extent header at block %u (linked from %u)",bn,prev);
+			break;
+		}
+		x=f->s.x+i;
+		if(f->walk[i]==f->nwalk)
+		{
+			fsck_err(f,id,"extent chain loops at %u",bn);
+			break;
+		}
+		f->walk[i]=f->nwalk;
+		if(x->h.prev_xtnt!=prev)
+			fsck_err(f,id,"extent %u: prev link is %u, expected %u",bn,x->h.prev_xtnt,prev);
+		fsck_own(f,id,x);
+		if(isdir)
+		{
+			if(nx==cxl)
+			{
+				cxl=cxl ? cxl*2 : 8;
+				if((nxl=realloc(xl,cxl*sizeof(uint32_t)))==NULL)
+				{
+					fsck_err(f,id,"alloc error!");
+					break;
+				}
+				xl=nxl;
+			}
+			xl[nx]=i;
+		}
+		nx++;
+		size+=x->h.size_xtnt;
+		last=prev=bn;
+	}
+
+	if(de->fnum_xtnt!=nx)
+		fsck_err(f,id,"%u extent%s, directory entry says %u",nx,nx==1 ? "" : "s",de->fnum_xtnt);
+	if((uint32_t)de->flast_xtnt!=last)
+		fsck_err(f,id,"last extent is %u, directory entry says %d",last,de->flast_xtnt);
+	dsize=(int64_t)(1+de->fnum_blks)*Q_BLOCKSIZE-de->fnum_chars_free;
+	if(f->qnx2 && dsize!=(int64_t)size)
+		fsck_err(f,id,"size is %" PRIu64 ", directory entry says %" PRId64 " (blocks %d, free %u)",size,dsize,de->fnum_blks,de->fnum_chars_free);
+
+	if(isdir)
+	{
+		if(shared)
+			printf("%s: same directory as %s, contents not checked again\n",f->path[id],f->path[shared-1]);
+		else if(depth<MAX_DEPTH)
+			fsck_dir(f,id,xl,nx,size,depth);
+		else
+			fsck_err(f,id,"directories nested too deep, not checked");
+	}
+	free(xl);
+}
+
+/* extent chains owned by no file (deleted or lost) */
+static uint32_t fsck_lost(fsck *f, uint64_t *bytes)
+{
+	qs_chain *c;
+	uint32_t i,n=0;
+
+	for(i=0;i<f->s.nc;i++)
+	{
+		c=f->s.c+i;
+		/* inside a file (data looking like a header) or empty */
+		if(f->owner[f->s.x[c->first].bn] || !c->size)
+			continue;
+		n++;
+		*bytes+=c->size;
+	}
+	return n;
+}
+
+int qfsck(qnx_disk *qd, int qnx2)
+{
+	fsck f;
+	struct q_block1 sb;
+	uint32_t i,nlost;
+	uint64_t lbytes=0;
+
+	memset(&f,0,sizeof(f));
+	f.qd=qd;
+	f.qnx2=qnx2;
+	if(qd_read(qd,&sb,0,sizeof(sb)))
+	{
+		printf("can't read superblock\n");
+		return 2;
+	}
+	if(qs_scan(qd,&f.s,QS_ALL))
+	{
+		printf("image scan failed\n");
+		return 2;
+	}
+	if((f.owner=calloc((size_t)f.s.nblocks+1,sizeof(uint32_t)))==NULL ||
+		(f.walk=calloc((size_t)f.s.nx+1,sizeof(uint32_t)))==NULL)
+	{
+		free(f.owner);
+		qs_free(&f.s);
+		printf("can't allocate block map (%u blocks)\n",f.s.nblocks);
+		return 2;
+	}
+	f.owner[1]=1;	/* superblock, owned by root (id 0) */
+	f.nused=1;
+
+	if(fsck_addpath(&f,"",(const uint8_t *)"/")!=QS_NONE)
+		fsck_file(&f,&sb.root_dir,0,0);
+	nlost=fsck_lost(&f,&lbytes);
+
+	printf("%u files, %u directories, %" PRIu64 "/%u blocks used, %u extent headers\n",
+		f.nfiles,f.ndirs,f.nused,f.s.nblocks,f.s.nx);
+	if(nlost)
+		printf("%u lost extent chains (%" PRIu64 " bytes), see qdump -s\n",nlost,lbytes);
+	printf("%u error%s\n",f.nerr,f.nerr==1 ? "" : "s");
+
+	for(i=0;i<f.npath;i++)
+		free(f.path[i]);
+	free(f.path);
+	free(f.owner);
+	free(f.walk);
+	qs_free(&f.s);
+	return f.nerr ? 1 : 0;
+}
+
+void exit_usage(char *pn, int rv)
+{
+	printf("Usage: %s <disk_image> [-2] [-m] [-o offset | -p n]\n",pn);
+	printf("\t-2\tQNX 2.x image (check file sizes against directory entries)\n");
+	printf("\t-m\tmemory-map image file instead of reading it\n");
+	printf("\t-o\tOffset (in bytes) into image file (e.g. for partition)\n");
+	printf("\t-p\tcheck partition n of a partitioned disk image\n");
+	printf("\nExit status: 0 - no errors, 1 - errors found, 2 - check failed\n");
+	exit(rv);
+}
+
+int main(int argc, char *argv[])
+{
+	qnx_disk qd,pqd;
+	qd_part parts[MAX_PARTS];
+	uint64_t ioff=0;
+	char *ep;
+	int or,e=0;
+	int qnx2=0,oflags=0,pnum=0;
+	int i,n,rv;
+
+	while((or=getopt(argc,argv,"2mo:p:"))!=-1)
+	{
+		switch(or)
+		{
+			case '2':
+				qnx2=1;
+				oflags |= QDO_QNX2;
+				break;
+			case 'm':
+				oflags |= QDO_MMAP;
+				break;
+			case 'o':
+				errno=0;
+				ioff=strtoull(optarg,&ep,10);
+				if(errno || ep==optarg || *ep || optarg[0]=='-')
+				{
+					fprintf(stderr,"Invalid offset %s\n",optarg);
+					e=1;
+				}
+				break;
+			case 'p':
+				if((pnum=atoi(optarg))<1)
+				{
+					fprintf(stderr,"Invalid partition %s\n",optarg);
+					e=1;
+				}
+				break;
+			default:
+				e=1;
+				break;
+		}
+	}
+	if(e || optind>=argc || (ioff && pnum))
+		exit_usage(argv[0],2);
+
+	if(qd_open(&qd,argv[optind],ioff,oflags))
+	{
+		fprintf(stderr,"Unable to open image file %s\n",argv[optind]);
+		return 2;
+	}
+	if(!pnum)
+		rv=qfsck(&qd,qnx2);
+	else
+	{
+		n=qd_read_parts(&qd,parts,MAX_PARTS);
+		for(i=0;i<n && parts[i].num!=pnum;i++);
+		if(i>=n)
+		{
+			fprintf(stderr,"No partition %d in %s\n",pnum,argv[optind]);
+			rv=2;
+		}
+		else if(qd_open_view(&pqd,&qd,parts[i].start,parts[i].size))
+			rv=2;
+		else
+		{
+			rv=qfsck(&pqd,qnx2);
+			qd_close(&pqd);
+		}
+	}
+	qd_close(&qd);
+	return rv;
+}
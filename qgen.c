@@ -0,0 +1,317 @@
+/* qgen.c - synthetic QNX (1.2) filesystem image generator (for benchmarks)
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* Builds a tree of depth levels below the root, fanout subdirectories per
+ * directory, with the files spread evenly over all directories. File data
+ * is pseudo-random and split into extents of at most xmax bytes; before
+ * each extent a few blocks are skipped with probability gap%, so chains
+ * are scattered over the image as on a well used disk. Blocks are handed
+ * out in order and written once (children before their directory, the
+ * root last, then the superblock); skipped blocks are left as holes. */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "qnx_acc.h"
+#include "qnx_rand.h"
+
+#define QG_MAXDEPTH 16
+#define QG_MAXBLKS	0x7fffffff	/* block numbers are signed in directory entries */
+
+typedef struct qgen
+{
+	int fd;
+	uint32_t nb;		/* blocks used so far (block 1 is the superblock) */
+	uint32_t nfiles;	/* files to create */
+	uint32_t depth;
+	uint32_t fanout;
+	uint32_t smin,smax;	/* file size range */
+	uint32_t xmax;		/* max. data bytes per extent */
+	uint32_t gap;		/* % of extents preceded by a gap */
+	int qnx1;			/* leave QNX 2.x size fields empty */
+	uint64_t rng;
+	uint32_t ndirs;		/* total directories, root excluded */
+	uint32_t dirno;		/* directories done */
+	uint32_t fileno;	/* files done */
+	uint64_t dbytes;	/* file data bytes */
+	uint64_t nxtnt;
+	uint8_t *buf;		/* smax bytes */
+} qgen;
+
+/* len bytes of data at buf as a chain of extents; fills the extent and
+ * size fields of de */
+static int qg_chain(qgen *g, const uint8_t *buf, uint32_t len, uint32_t xmax, struct q_dir_entry *de)
+{
+	uint32_t nx=len ? (len+xmax-1)/xmax : 1;
+	uint32_t *bn;
+	uint32_t i,l,nblk;
+	uint8_t *xb;
+	struct q_xtnt_header *h;
+	uint64_t blks=0;
+
+	if((bn=malloc(nx*sizeof(uint32_t)))==NULL || (xb=malloc(sizeof(struct q_xtnt_header)+xmax+Q_BLOCKSIZE))==NULL)
+	{
+		free(bn);
+		func_abort("alloc error!");
+	}
+	for(i=0;i<nx;i++)
+	{
+		l=MIN(len-i*xmax,xmax);
+		nblk=(sizeof(struct q_xtnt_header)+l+Q_BLOCKSIZE-1)/Q_BLOCKSIZE;
+		if(g->nb>QG_MAXBLKS-4-nblk)	/* gap included */
+		{
+			free(bn);
+			free(xb);
+			func_abort("image too large (more than %u blocks)",QG_MAXBLKS);
+		}
+		if(g->gap && qnx_rand(&g->rng)%100<g->gap)
+			g->nb+=1+qnx_rand(&g->rng)%4;
+		bn[i]=g->nb+1;
+		g->nb+=nblk;
+	}
+	for(i=0;i<nx;i++)
+	{
+		l=MIN(len-i*xmax,xmax);
+		nblk=(sizeof(struct q_xtnt_header)+l+Q_BLOCKSIZE-1)/Q_BLOCKSIZE;
+		memset(xb,0,nblk*Q_BLOCKSIZE);
+		h=(struct q_xtnt_header *)xb;
+		h->prev_xtnt=i ? bn[i-1] : 0;
+		h->next_xtnt=(i+1<nx) ? bn[i+1] : 0;
+		h->size_xtnt=l;
+		h->bound_xtnt=nblk;
+		memcpy(xb+sizeof(struct q_xtnt_header),buf+(uint64_t)i*xmax,l);
+		if(pwrite(g->fd,xb,nblk*Q_BLOCKSIZE,QBN2OFF(bn[i]))!=nblk*Q_BLOCKSIZE)
+		{
+			free(bn);
+			free(xb);
+			func_abort("write error: %s",strerror(errno));
+		}
+		blks+=nblk;
+	}
+	de->ffirst_xtnt=bn[0];
+	de->flast_xtnt=bn[nx-1];
+	de->fnum_xtnt=nx;
+	if(!g->qnx1)	/* see qnx_fsize_dirent */
+	{
+		de->fnum_blks=len ? (len-1)/Q_BLOCKSIZE : 0;
+		de->fnum_chars_free=(de->fnum_blks+1)*Q_BLOCKSIZE-len;
+	}
+	g->nxtnt+=nx;
+	free(bn);
+	free(xb);
+	return 0;
+}
+
+static void qg_dirent(struct q_dir_entry *de, const char *name, int dir)
+{
+	memset(de,0,sizeof(struct q_dir_entry));
+	de->fstat=1;
+	de->fowner=3;
+	de->fgroup=4;
+	de->fseconds=1600000000;
+	de->fgperms=7;
+	de->fperms=7;
+	de->fattr=dir ? QFA_DIRECTORY : 0;
+	de->fdate[0]=1;
+	de->fdate[1]=2;
+	memcpy(de->fname,name,MIN(strlen(name),QNX_MAXFNLEN));
+}
+
+/* directory at level lvl (root is 0) with its subtree; entry goes to de */
+static int qg_dir(qgen *g, uint32_t lvl, const char *name, struct q_dir_entry *de)
+{
+	uint32_t nsub=(lvl<g->depth) ? g->fanout : 0;
+	uint32_t nf=g->nfiles/(g->ndirs+1)+(g->dirno<g->nfiles%(g->ndirs+1));
+	uint32_t n=0,i,j,r,fl;
+	struct q_dir_cont *dc;
+	char fn[QNX_MAXFNLEN+1];
+	int rv=0;
+
+	g->dirno++;
+	if((dc=calloc(1,sizeof(struct q_dir_cont)+(nsub+nf)*sizeof(struct q_dir_entry)))==NULL)
+		func_abort("alloc error!");
+	for(i=0;i<nsub && !rv;i++)
+	{
+		snprintf(fn,sizeof(fn),"d%u",i);
+		rv=qg_dir(g,lvl+1,fn,&dc->de[n++]);
+	}
+	for(i=0;i<nf && !rv;i++)
+	{
+		fl=g->smin+(g->smax>g->smin ? qnx_rand(&g->rng)%(g->smax-g->smin+1) : 0);
+		for(j=0;j<fl;j+=4)
+		{
+			r=qnx_rand(&g->rng);
+			memcpy(g->buf+j,&r,MIN(4,fl-j));
+		}
+		snprintf(fn,sizeof(fn),"f%05u",g->fileno++);
+		qg_dirent(&dc->de[n],fn,0);
+		rv=qg_chain(g,g->buf,fl,g->xmax,&dc->de[n++]);
+		g->dbytes+=fl;
+	}
+	if(!rv)
+	{
+		qg_dirent(de,name,1);
+		rv=qg_chain(g,(uint8_t *)dc,sizeof(struct q_dir_cont)+n*sizeof(struct q_dir_entry),MAX(g->xmax,Q_BLOCKSIZE),de);
+	}
+	free(dc);
+	return rv;
+}
+
+int qgen_image(qgen *g)
+{
+	struct q_block1 sb;
+	uint32_t i,p=1;
+
+	for(i=0,g->ndirs=0;i<g->depth;i++)
+		g->ndirs+=(p*=g->fanout);
+	if((g->buf=malloc(g->smax+4))==NULL)
+		func_abort("alloc error!");
+	g->nb=1;
+	memset(&sb,0,sizeof(sb));
+	if(qg_dir(g,0,"/",&sb.root_dir))
+	{
+		free(g->buf);
+		return -1;
+	}
+	free(g->buf);
+	sb.header.bound_xtnt=1;
+	if(pwrite(g->fd,&sb,sizeof(sb),0)!=sizeof(sb) || ftruncate(g->fd,(off_t)g->nb*Q_BLOCKSIZE))
+		func_abort("write error: %s",strerror(errno));
+	return 0;
+}
+
+/* whole of s as a number, *e set if there is anything else */
+static uint32_t qg_num(const char *s, int *e)
+{
+	char *ep;
+	unsigned long v;
+
+	errno=0;
+	v=strtoul(s,&ep,0);
+	if(ep==s || *ep || errno || v>UINT32_MAX)
+		*e=1;
+	return v;
+}
+
+void exit_usage(char *pn, int rv)
+{
+	printf("Usage: %s <image> [-n files] [-d depth] [-f fanout] [-s min[:max]] [-x bytes] [-g percent] [-r seed] [-1]\n",pn);
+	printf("\t-n\tnumber of files (default 1000)\n");
+	printf("\t-d\tdirectory levels below the root (default 2, max %d)\n",QG_MAXDEPTH);
+	printf("\t-f\tsubdirectories per directory (default 4)\n");
+	printf("\t-s\tfile size range in bytes (default 0:65536)\n");
+	printf("\t-x\tmax. data bytes per extent (default 16384, at most 65535 extents per file or directory)\n");
+	printf("\t-g\tpercent of extents placed after a gap of 1-4 blocks (default 25)\n");
+	printf("\t-r\trandom seed (default 1)\n");
+	printf("\t-1\tQNX 1.x style entries (no size in the directory, see qdump -2)\n");
+	exit(rv);
+}
+
+int main(int argc, char *argv[])
+{
+	qgen g;
+	char *ep;
+	int or,e=0;
+	uint64_t ndirs,dsize;
+	uint32_t i;
+
+	memset(&g,0,sizeof(g));
+	g.nfiles=1000;
+	g.depth=2;
+	g.fanout=4;
+	g.smax=65536;
+	g.xmax=16384;
+	g.gap=25;
+	g.rng=1;
+
+	while((or=getopt(argc,argv,"n:d:f:s:x:g:r:1"))!=-1)
+	{
+		switch(or)
+		{
+			case 'n':
+				g.nfiles=qg_num(optarg,&e);
+				break;
+			case 'd':
+				g.depth=qg_num(optarg,&e);
+				break;
+			case 'f':
+				g.fanout=qg_num(optarg,&e);
+				break;
+			case 's':
+				if((ep=strchr(optarg,':'))!=NULL)
+				{
+					*ep='\0';
+					g.smax=qg_num(ep+1,&e);
+					g.smin=qg_num(optarg,&e);
+				}
+				else
+					g.smin=g.smax=qg_num(optarg,&e);
+				break;
+			case 'x':
+				g.xmax=qg_num(optarg,&e);
+				break;
+			case 'g':
+				g.gap=qg_num(optarg,&e);
+				break;
+			case 'r':
+				g.rng=strtoull(optarg,&ep,0)*2+1;	/* never 0 */
+				if(ep==optarg || *ep)
+					e=1;
+				break;
+			case '1':
+				g.qnx1=1;
+				break;
+			default:
+				e=1;
+				break;
+		}
+	}
+	for(i=0,ndirs=0;!e && i<g.depth && ndirs<=UINT16_MAX;i++)
+		ndirs=ndirs*g.fanout+g.fanout;
+	/* largest directory; extent counts must fit fnum_xtnt */
+	dsize=sizeof(struct q_dir_cont)+(g.fanout+g.nfiles/(ndirs+1)+1)*(uint64_t)sizeof(struct q_dir_entry);
+	if(e || optind>=argc || g.depth>QG_MAXDEPTH || (g.depth && !g.fanout) || ndirs>UINT16_MAX ||
+		g.smin>g.smax || g.smax>(1<<30) || g.xmax<1 || g.gap>100 ||
+		(g.smax+(uint64_t)g.xmax-1)/g.xmax>UINT16_MAX || dsize>(1<<30) ||
+		(dsize+MAX(g.xmax,Q_BLOCKSIZE)-1)/MAX(g.xmax,Q_BLOCKSIZE)>UINT16_MAX)
+		exit_usage(argv[0],EXIT_FAILURE);
+
+	if((g.fd=open(argv[optind],O_CREAT | O_TRUNC | O_WRONLY,0644))<0)
+	{
+		fprintf(stderr,"Unable to create %s\n",argv[optind]);
+		return 1;
+	}
+	if(qgen_image(&g))
+	{
+		close(g.fd);
+		return 1;
+	}
+	close(g.fd);
+	printf("%s: %u files (%" PRIu64 " bytes, %" PRIu64 " extents), %u directories, %u blocks\n",
+		argv[optind],g.fileno,g.dbytes,g.nxtnt,g.ndirs+1,g.nb);
+	return 0;
+}
@@ -28,81 +28,559 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
 #include "qnx_acc.h"
+#include "qnx_gz.h"
+#include "qnx_imd.h"
 
 
 /* disk image access */
+
+/* per-view state (everything except the shared image) */
+static void qd_init_view(qnx_disk *qd, uint64_t ioff, int oflags)
+{
+	pthread_mutex_init(&qd->lock,NULL);
+	qd->ioff=ioff;
+	qd->oflags=oflags;
+	memset(&qd->cache,0,sizeof(qd_cache));
+	memset(qd->szmemo,0,sizeof(qd->szmemo));
+	qd->dcache=calloc(QDC_SIZE,sizeof(qd_dentry));	/* optional, NULL is fine */
+	qd->dhash=NULL;
+	qd->ndhash=qd->dhnext=0;
+	memset(qd->pfring,0,sizeof(qd->pfring));
+	qd->pfnext=0;
+	memset(&qd->pf,0,sizeof(qd_pfstat));
+}
+
+/* plain image file: pread (or the whole file mapped, with QDO_MMAP) */
+static int qd_raw_probe(int fd)
+{
+	return 1;
+}
+
+static int qd_raw_open(qd_image *img, const char *path, int oflags)
+{
+	struct stat s;
+	void *m;
+
+	if(fstat(img->fd,&s) == -1)
+		func_abort("fstat error on %s",path);
+	img->isize=s.st_size;
+	if((oflags & QDO_MMAP) && img->isize && img->isize <= SIZE_MAX)
+	{
+		m=mmap(NULL,img->isize,PROT_READ,MAP_PRIVATE,img->fd,0);
+		if(m==MAP_FAILED)
+			func_msg("can't map %s, using read(2)",path);
+		else
+			img->map=(uint8_t *)m;
+	}
+	return 0;
+}
+
+static int qd_raw_read(qd_image *img, void *buf, uint64_t off, uint32_t count)
+{
+	uint8_t *dbuf=(uint8_t *)buf;
+	ssize_t rr;
+
+	while(count)
+	{
+		rr=pread(img->fd,dbuf,count,off);
+		__atomic_add_fetch(&img->nsys,1,__ATOMIC_RELAXED);
+		if(rr<=0)
+			return -1;
+		__atomic_add_fetch(&img->nbytes,rr,__ATOMIC_RELAXED);
+		count-=rr;
+		dbuf+=rr;
+		off+=rr;
+	}
+	return 0;
+}
+
+static void qd_raw_close(qd_image *img)
+{
+	if(img->map!=NULL)
+		munmap(img->map,img->isize);
+}
+
+/* kernel readahead of the range (same as readahead(2), but portable) */
+static void qd_raw_prefetch(qd_image *img, uint64_t off, uint32_t count)
+{
+	posix_fadvise(img->fd,off,count,POSIX_FADV_WILLNEED);
+	__atomic_add_fetch(&img->nsys,1,__ATOMIC_RELAXED);
+}
+
+const qd_backend qd_raw_backend={"raw",qd_raw_probe,qd_raw_open,qd_raw_read,qd_raw_close,qd_raw_prefetch};
+
+/* probed in this order, raw (accepts anything) last */
+static const qd_backend *qd_backends[]={&qgz_backend,&qimd_backend,&qd_raw_backend,NULL};
+
 int qd_close(qnx_disk *qd)
 {
-	close(qd->fd);
+	qd_image *img=qd->img;
+	int refs;
+
+	qd_cache_init(qd,0);
+	qd_dirhash_init(qd,0);
+	free(qd->dcache);
+	qd->dcache=NULL;
+	pthread_mutex_destroy(&qd->lock);
+	qd->img=NULL;
+	qd->map=NULL;
 	qd->fd = -1;
+	if(img==NULL)
+		return 0;
+
+	/* last view closes the image */
+	pthread_mutex_lock(&img->lock);
+	refs=--img->refs;
+	pthread_mutex_unlock(&img->lock);
+	if(refs)
+		return 0;
+	if(img->be!=NULL)
+		img->be->close(img);
+	if(img->fd!=-1)
+		close(img->fd);
+	pthread_mutex_destroy(&img->lock);
+	free(img);
 	return 0;
 }
 
-int qd_open(qnx_disk *qd, char *path, uint32_t ioff)
+int qd_open(qnx_disk *qd, char *path, uint64_t ioff, int oflags)
 {
-	struct stat s;
-	qd->fd=open(path,O_RDONLY);
-	if(qd->fd == -1)
-		func_abort("%s open error",path);
-	if(fstat(qd->fd,&s) == -1)
+	qd_image *img;
+	const qd_backend *be;
+	int i;
+
+	qd_init_view(qd,ioff,oflags & (QDO_QNX2|QDO_PREFETCH));
+	qd->map=NULL;
+	qd->fd=-1;
+	if((qd->img=img=calloc(1,sizeof(qd_image)))==NULL)
 	{
 		qd_close(qd);
-		func_abort("fstat error on %s",path);
+		func_abort("alloc error!");
 	}
-	if(s.st_size > 0x7fffffff)	/* we have to draw the line somewhere, 2GB should be enough.. :) */
+	pthread_mutex_init(&img->lock,NULL);
+	img->refs=1;
+	img->fd=open(path,O_RDONLY);	/* (closed by qd_close on errors below) */
+	if(img->fd == -1)
 	{
 		qd_close(qd);
-		func_abort("image too big (%lu bytes)",(unsigned long)s.st_size);
+		func_abort("%s open error",path);
 	}
-	qd->isize=s.st_size;
-	qd->ioff=ioff;
+
+	/* a backend that recognizes the file but can't open it (e.g. a plain
+	 * image that happens to start like zlib data) passes it on */
+	for(i=0;(be=qd_backends[i])!=NULL;i++)
+	{
+		if(!be->probe(img->fd))
+			continue;
+		if(!be->open(img,path,oflags))
+			break;
+		img->priv=NULL;
+		img->map=NULL;
+		img->isize=0;
+		if(be==&qd_raw_backend)
+		{
+			qd_close(qd);
+			func_abort("can't read image %s",path);
+		}
+		func_msg("%s is not a readable %s image, trying next format",path,be->name);
+	}
+	img->be=be;
+	if(img->map!=NULL)
+		qd->oflags |= QDO_MMAP;
+	if(be!=&qd_raw_backend)
+	{
+		qd->oflags |= QDO_NORAW;
+		if(oflags & QDO_MMAP)
+			func_msg("can't map %s image %s, reading it through its backend",be->name,path);
+	}
+	if(ioff > img->isize)
+	{
+		qd_close(qd);
+		func_abort("offset %" PRIu64 " beyond end of %s",ioff,path);
+	}
+	qd->fd=img->fd;
+	qd->isize=img->isize;
+	qd->map=img->map;
 	return 0;
 }
 
-/* read sector from disk. Even though this function is mostly called from
- * qd_read, it's better to have this separation for the unlikely scenario of
- * using a block device or an IMD file */
+int qd_open_view(qnx_disk *qd, qnx_disk *base, uint64_t ioff, uint64_t size)
+{
+	if(ioff > base->img->isize)
+		func_abort("offset %" PRIu64 " beyond end of image",ioff);
+	qd_init_view(qd,ioff,base->oflags);	/* incl. QDO_MMAP/QDO_NORAW as found by qd_open */
+	qd->img=base->img;
+	qd->fd=base->fd;
+	/* reads are bounds checked against isize, so it ends the partition */
+	qd->isize=(size && size < base->img->isize-ioff) ? ioff+size : base->img->isize;
+	qd->map=base->map;
+	pthread_mutex_lock(&qd->img->lock);
+	qd->img->refs++;
+	pthread_mutex_unlock(&qd->img->lock);
+	return 0;
+}
+
+/* ring slot of a prefetched range containing [roff, roff+count), -1 if
+ * none (qd->lock held) */
+static int qd_pf_find(qnx_disk *qd, uint64_t roff, uint32_t count)
+{
+	int i;
+
+	for(i=0;i<QPF_RING;i++)
+		if(qd->pfring[i].len && roff>=qd->pfring[i].off &&
+			roff+count<=qd->pfring[i].off+qd->pfring[i].len)
+			return i;
+	return -1;
+}
+
+/* prefetch accounting for a read of count bytes at absolute offset roff */
+static void qd_pf_use(qnx_disk *qd, uint64_t roff, uint32_t count)
+{
+	int i;
+
+	if(!(qd->oflags & QDO_PREFETCH))
+		return;
+	pthread_mutex_lock(&qd->lock);
+	if((i=qd_pf_find(qd,roff,count))>=0)
+	{
+		qd->pfring[i].hit=1;
+		qd->pf.hits++;
+	}
+	else
+		qd->pf.misses++;
+	pthread_mutex_unlock(&qd->lock);
+}
+
+/* read from image at absolute offset roff (ioff not added), through the
+ * image backend unless the whole image is mapped */
+static int qd_pread(qnx_disk *qd, void *buf, uint32_t count, uint64_t roff)
+{
+	qd_pf_use(qd,roff,count);
+	if(qd->map!=NULL)
+	{
+		memcpy(buf,qd->map+roff,count);
+		return 0;
+	}
+	return qd->img->be->read(qd->img,buf,roff,count);
+}
+
+void qd_prefetch(qnx_disk *qd, uint64_t offset, uint32_t count)
+{
+	uint64_t roff;
+	uint64_t pg,end;
+	int i;
+
+	if(!(qd->oflags & QDO_PREFETCH) || !count || (qd->map==NULL && qd->img->be->prefetch==NULL))
+		return;
+	/* whole sectors, reads are done (and checked against the ring) in sectors */
+	end=qd->ioff+offset+count;
+	end+=(Q_BLOCKSIZE-(end-qd->ioff)%Q_BLOCKSIZE)%Q_BLOCKSIZE;
+	roff=qd->ioff+offset-offset%Q_BLOCKSIZE;
+	if(roff>=qd->isize)
+		return;
+	count=MIN(end,qd->isize)-roff;
+
+	pthread_mutex_lock(&qd->lock);
+	if(qd_pf_find(qd,roff,count)>=0)	/* already asked for */
+	{
+		pthread_mutex_unlock(&qd->lock);
+		return;
+	}
+	i=qd->pfnext;
+	qd->pfnext=(i+1)%QPF_RING;
+	if(qd->pfring[i].len && !qd->pfring[i].hit)
+		qd->pf.unused++;
+	qd->pfring[i].off=roff;
+	qd->pfring[i].len=count;
+	qd->pfring[i].hit=0;
+	qd->pf.issued++;
+	qd->pf.bytes+=count;
+	pthread_mutex_unlock(&qd->lock);
+
+	if(qd->map!=NULL)
+	{
+		pg=sysconf(_SC_PAGESIZE);
+		end=roff+count;
+		roff-=roff%pg;
+		madvise(qd->map+roff,end-roff,MADV_WILLNEED);
+		__atomic_add_fetch(&qd->img->nsys,1,__ATOMIC_RELAXED);
+	}
+	else if(qd->img->be->prefetch!=NULL)
+		qd->img->be->prefetch(qd->img,roff,count);
+}
+
+void qd_prefetch_used(qnx_disk *qd, uint64_t offset, uint32_t count)
+{
+	qd_pf_use(qd,qd->ioff+offset,count);
+}
+
+void qd_prefetch_stats(qnx_disk *qd, qd_pfstat *st)
+{
+	int i;
+
+	pthread_mutex_lock(&qd->lock);
+	*st=qd->pf;
+	for(i=0;i<QPF_RING;i++)	/* still in the ring, never read */
+		if(qd->pfring[i].len && !qd->pfring[i].hit)
+			st->unused++;
+	pthread_mutex_unlock(&qd->lock);
+}
+
+/* partition table (MBR, extended partitions are followed) */
+static int qd_read_pt(qnx_disk *qd, uint64_t off, uint8_t *sec)
+{
+	if(off+Q_BLOCKSIZE > qd->isize || qd_pread(qd,sec,Q_BLOCKSIZE,off))
+		return -1;
+	if(sec[510]!=0x55 || sec[511]!=0xaa)
+		return -1;
+	return 0;
+}
+
+int qd_read_parts(qnx_disk *qd, qd_part *p, int maxp)
+{
+	uint8_t sec[Q_BLOCKSIZE];
+	struct q_mbr_part pt[4],*e;
+	uint64_t ext=0,ebr;
+	int i,n=0,lnum=5;
+
+	if(qd_read_pt(qd,0,sec))
+		return 0;	/* no partition table */
+	memcpy(pt,sec+446,sizeof(pt));	/* 446 is not aligned */
+	for(i=0;i<4;i++)
+	{
+		e=pt+i;
+		if(!e->type || !e->nsect)
+			continue;
+		if(QD_ISEXTPART(e->type))
+		{
+			if(!ext)
+				ext=(uint64_t)e->lba*Q_BLOCKSIZE;
+			continue;
+		}
+		if(n<maxp)
+		{
+			p[n].num=i+1;
+			p[n].type=e->type;
+			p[n].start=(uint64_t)e->lba*Q_BLOCKSIZE;
+			p[n].size=(uint64_t)e->nsect*Q_BLOCKSIZE;
+			n++;
+		}
+	}
+
+	/* logical partitions: chain of EBRs, each one relative to its own start
+	 * (first entry) or to the extended partition start (link, second entry) */
+	for(ebr=ext;ebr && lnum<5+QD_MAXLOGICAL;lnum++)
+	{
+		if(qd_read_pt(qd,ebr,sec))
+		{
+			func_msg("bad extended partition table at %" PRIu64,ebr);
+			break;
+		}
+		memcpy(pt,sec+446,sizeof(pt));
+		e=pt;
+		if(e->type && e->nsect && n<maxp)
+		{
+			p[n].num=lnum;
+			p[n].type=e->type;
+			p[n].start=ebr+(uint64_t)e->lba*Q_BLOCKSIZE;
+			p[n].size=(uint64_t)e->nsect*Q_BLOCKSIZE;
+			n++;
+		}
+		e++;
+		ebr=(QD_ISEXTPART(e->type) && e->lba) ? ext+(uint64_t)e->lba*Q_BLOCKSIZE : 0;
+	}
+	return n;
+}
+
+/* mapped image access - offset is relative to ioff, like for qd_read */
+const void *qd_map(qnx_disk *qd, uint64_t offset, uint32_t count)
+{
+	uint64_t roff=qd->ioff+offset;
+	if(qd->map==NULL)
+		return NULL;
+	if(roff+count > qd->isize)
+	{
+		func_msg("Trying to map beyond end of image (offset %" PRIu64 ", count %u)",roff,count);
+		return NULL;
+	}
+	qd_pf_use(qd,roff,count);
+	return qd->map+roff;
+}
+
+/* sector cache */
+static void qc_free(qd_cache *c)
+{
+	free(c->arena);
+	free(c->ssn);
+	free(c->snext);
+	free(c->bucket);
+	free(c->ref);
+	memset(c,0,sizeof(qd_cache));
+}
+
+int qd_cache_init(qnx_disk *qd, uint32_t nslots)
+{
+	qd_cache *c=&qd->cache;
+	uint32_t nb=1;
+
+	qc_free(c);
+	if(!nslots)
+		return 0;
+
+	while(nb<nslots) nb<<=1;	/* at least one bucket per slot */
+	c->arena=malloc((size_t)nslots*Q_BLOCKSIZE);
+	c->ssn=malloc(nslots*sizeof(uint32_t));
+	c->snext=malloc(nslots*sizeof(uint32_t));
+	c->bucket=malloc(nb*sizeof(uint32_t));
+	c->ref=calloc(nslots,1);
+	if(!c->arena || !c->ssn || !c->snext || !c->bucket || !c->ref)
+	{
+		qc_free(c);
+		func_abort("can't allocate cache (%u slots)",nslots);
+	}
+	memset(c->ssn,0xff,nslots*sizeof(uint32_t));
+	memset(c->snext,0xff,nslots*sizeof(uint32_t));
+	memset(c->bucket,0xff,nb*sizeof(uint32_t));
+	c->nslots=nslots;
+	c->hmask=nb-1;
+	return 0;
+}
+
+static inline uint32_t qc_hash(qd_cache *c, uint32_t sn)
+{
+	return (sn*2654435761u) & c->hmask;
+}
+
+/* find slot holding sn, or QC_EMPTY */
+static uint32_t qc_lookup(qd_cache *c, uint32_t sn)
+{
+	uint32_t i;
+	for(i=c->bucket[qc_hash(c,sn)];i!=QC_EMPTY;i=c->snext[i])
+		if(c->ssn[i]==sn)
+			return i;
+	return QC_EMPTY;
+}
+
+/* pick a victim slot (CLOCK) and unlink it from its bucket */
+static uint32_t qc_evict(qd_cache *c)
+{
+	uint32_t i,*pp;
+
+	while(c->ref[c->hand])
+	{
+		c->ref[c->hand]=0;
+		c->hand=(c->hand+1)%c->nslots;
+	}
+	i=c->hand;
+	c->hand=(c->hand+1)%c->nslots;
+
+	if(c->ssn[i]!=QC_EMPTY)
+	{
+		for(pp=&c->bucket[qc_hash(c,c->ssn[i])];*pp!=i;pp=&c->snext[*pp]);
+		*pp=c->snext[i];
+		c->ssn[i]=QC_EMPTY;
+	}
+	return i;
+}
+
+/* read sector from disk (through the sector cache, if any). Image formats
+ * are handled below this, by the qd_backend of the image */
 int qd_read_sector(qnx_disk *qd, uint32_t sn, void *buf)
 {
-	uint8_t *dbuf=(uint8_t *)buf;
-	uint32_t br=Q_BLOCKSIZE;
-	uint32_t roff=qd->ioff+Q_BLOCKSIZE*sn;
-	int32_t rr;
-	if(roff+Q_BLOCKSIZE > qd->isize)
-		func_abort("Trying to read beyond end of image (sector %u, offset %u)",sn,roff);
-	if(lseek(qd->fd,roff,SEEK_SET)!=roff)
-		func_abort("Seek error (sector %u, offset %u)\n",sn,roff);
+	qd_cache *c=&qd->cache;
+	uint32_t i,h;
 
-	while(br)
+	if(!c->nslots || qd->map!=NULL)
+		return qd_read_sectors(qd,sn,1,buf);
+
+	pthread_mutex_lock(&qd->lock);
+	if((i=qc_lookup(c,sn))!=QC_EMPTY)
 	{
-		rr=read(qd->fd,dbuf,br);
-		if(rr<=0)
-			func_abort("Error reading from image file (sector %u, offset %u)\n",sn,roff);
-		br-=rr;
-		dbuf+=rr;
+		c->hits++;
+		c->ref[i]=1;
+		memcpy(buf,c->arena+(size_t)i*Q_BLOCKSIZE,Q_BLOCKSIZE);
+		pthread_mutex_unlock(&qd->lock);
+		return 0;
+	}
+	c->misses++;
+	pthread_mutex_unlock(&qd->lock);
+
+	/* don't hold the lock during I/O - read into buf and copy to cache */
+	if(qd_read_sectors(qd,sn,1,buf))
+		return -1;
+
+	pthread_mutex_lock(&qd->lock);
+	if(qc_lookup(c,sn)==QC_EMPTY)	/* another thread might have added it */
+	{
+		i=qc_evict(c);
+		h=qc_hash(c,sn);
+		memcpy(c->arena+(size_t)i*Q_BLOCKSIZE,buf,Q_BLOCKSIZE);
+		c->ssn[i]=sn;
+		c->snext[i]=c->bucket[h];
+		c->bucket[h]=i;
+		c->ref[i]=1;
 	}
+	pthread_mutex_unlock(&qd->lock);
+	return 0;
+}
+
+/* read n consecutive sectors with a single backend read (pread plus
+ * retries for short reads, for plain images) - used by qd_read for the
+ * sector-aligned part of a request */
+int qd_read_sectors(qnx_disk *qd, uint32_t sn, uint32_t n, void *buf)
+{
+	uint64_t roff=qd->ioff+(uint64_t)Q_BLOCKSIZE*sn;
+	if(roff+(uint64_t)n*Q_BLOCKSIZE > qd->isize)
+		func_abort("Trying to read beyond end of image (sector %u, offset %" PRIu64 ")",sn,roff);
+	if(qd_pread(qd,buf,n*Q_BLOCKSIZE,roff))
+		func_abort("Error reading from image file (sector %u, offset %" PRIu64 ")\n",sn,roff);
 	return 0;
 }
 
-/* absolute read from disk image */
-int32_t qd_read(qnx_disk *qd, void *buf, uint32_t offset, uint32_t count)
+/* absolute read from disk image
+ * the sector-aligned middle of the range is read straight into buf,
+ * only the unaligned head and tail go through a (local) sector buffer */
+int32_t qd_read(qnx_disk *qd, void *buf, uint64_t offset, uint32_t count)
 {
 	uint8_t *dbuf=(uint8_t *)buf;
 	uint32_t br=count;
 	uint32_t sn;
 	uint32_t rs;	/* read size */
 	uint32_t soff;	/* offset in sector - only for first read */
+	uint8_t sbuf[Q_BLOCKSIZE];	/* on stack, so concurrent calls are safe */
+	const void *src;
+
+	/* mapped image: no need to go through sectors at all */
+	if(qd->map!=NULL)
+	{
+		if((src=qd_map(qd,offset,count))==NULL)
+			return -1;
+		memcpy(buf,src,count);
+		return 0;
+	}
 
 	while(br)
 	{
 		/* this could be optimized to bit operations */
 		sn=offset/Q_BLOCKSIZE;
 		soff=offset%Q_BLOCKSIZE;
-		rs=MIN(Q_BLOCKSIZE-soff,br);
-		if(qd_read_sector(qd,sn,qd->sbuf))
-			return -1;
-		memcpy(dbuf,qd->sbuf+soff,rs);
+		if(!soff && br>=Q_BLOCKSIZE)
+		{
+			rs=br-br%Q_BLOCKSIZE;
+			if(qd_read_sectors(qd,sn,rs/Q_BLOCKSIZE,dbuf))
+				return -1;
+		}
+		else
+		{
+			rs=MIN(Q_BLOCKSIZE-soff,br);
+			if(qd_read_sector(qd,sn,sbuf))
+				return -1;
+			memcpy(dbuf,sbuf+soff,rs);
+		}
 		dbuf+=rs;
 		br-=rs;
 		offset+=rs;
@@ -133,36 +611,101 @@ int32_t qnx_read_xtnt_data(qnx_disk *qd,uint32_t bn,uint32_t offset,void *buf,ui
 	/* qnx blocks are 1-based, so absolute offset (in bytes) on disk is:
 	 * (bn-1) * BLOCKSIZE + header_size + offset */
 
-	if(qd_read(qd,buf,(bn-1)*Q_BLOCKSIZE+sizeof(struct q_xtnt_header)+offset,count))
+	if(qd_read(qd,buf,QBN2OFF(bn)+sizeof(struct q_xtnt_header)+offset,count))
 		return -1;
 
 	return count;
 }
 
+/* pointer to extent data in mapped image, same checks as qnx_read_xtnt_data */
+const void *qnx_map_xtnt_data(qnx_disk *qd,uint32_t bn,uint32_t offset,uint32_t *count)
+{
+	const struct q_xtnt_header *h;
+
+	if(qd->map==NULL || !bn)
+		return NULL;
+	if((h=qd_map(qd,QBN2OFF(bn),sizeof(struct q_xtnt_header)))==NULL)
+	{
+		func_msg("unable to map extent %u",bn);
+		return NULL;
+	}
+	if(offset > h->size_xtnt)
+	{
+		func_msg("offset %u outside extent %u",offset,bn);
+		return NULL;
+	}
+	if(offset+*count > h->size_xtnt)
+		*count = h->size_xtnt - offset;
+
+	return qd_map(qd,QBN2OFF(bn)+sizeof(struct q_xtnt_header)+offset,*count);
+}
+
 /* read extent header at block number bn into h */
 int qnx_read_xh(qnx_disk *qd,uint32_t bn,struct q_xtnt_header *h)
 {
-	uint32_t bpos;
+	uint64_t bpos;
 
 	if(!bn) return -1;	/* block numbers are 1-based */
 
-	bpos=(bn-1)*Q_BLOCKSIZE;
+	bpos=QBN2OFF(bn);
 	return qd_read(qd,h,bpos,sizeof(struct q_xtnt_header));
 }
 
+/* check that extent data described by h (at block bn) lies inside the image
+ * after this, the cached size can be trusted (see qnx_read_fd_xtnt) */
+int qnx_check_xh(qnx_disk *qd, uint32_t bn, struct q_xtnt_header *h)
+{
+	uint64_t end=QBN2OFF(bn)+sizeof(struct q_xtnt_header)+h->size_xtnt;
+	if(!bn || qd->ioff+end > qd->isize)
+		func_abort("extent %u (size %u) goes beyond end of image",bn,h->size_xtnt);
+	return 0;
+}
+
+/* read from current extent of fd at xpos, using the header data cached in fd
+ * (no header re-read) - returns bytes read (trimmed to extent) or -1 */
+int32_t qnx_read_fd_xtnt(qnx_file *fd, void *buf, uint32_t count)
+{
+	if(fd->xpos > fd->xsize)
+		func_abort("offset %u outside extent %u",fd->xpos,fd->crtx);
+	if(fd->xpos+count > fd->xsize)
+		count = fd->xsize - fd->xpos;
+	if(!count) return 0;
+
+	if(qd_read(fd->qd,buf,QBN2OFF(fd->crtx)+sizeof(struct q_xtnt_header)+fd->xpos,count))
+		return -1;
+	return count;
+}
+
 /* helper function: sets fd fields to xtnt at bn */
 int qnx_set_fd_xtnt(qnx_file *fd, uint32_t bn)
 {
 	struct q_xtnt_header h;
 	if(qnx_read_xh(fd->qd,bn,&h)) return 1;
+	if(qnx_check_xh(fd->qd,bn,&h)) return 1;
 	fd->crtx = bn;
 	fd->nxtx = h.next_xtnt;
 	fd->prvx = h.prev_xtnt;
 	fd->xsize = h.size_xtnt;
+	/* the next header is the next dependent read when the chain is followed */
+	qd_prefetch(fd->qd,QBN2OFF(bn)+sizeof(struct q_xtnt_header),h.size_xtnt);
+	if(h.next_xtnt)
+		qd_prefetch(fd->qd,QBN2OFF(h.next_xtnt),Q_BLOCKSIZE);
 	return 0;
 }
 
 
+/* helper function: sets fd fields to extent map entry i */
+static void qnx_set_fd_xidx(qnx_file *fd, uint32_t i)
+{
+	fd->xidx = i;
+	fd->crtx = fd->xmap[i].bn;
+	fd->xsize = fd->xmap[i].size;
+	fd->prvx = i ? fd->xmap[i-1].bn : 0;
+	fd->nxtx = (i+1 < fd->nxmap) ? fd->xmap[i+1].bn : 0;
+	if(fd->nxtx)	/* read ahead one extent */
+		qd_prefetch(fd->qd,QBN2OFF(fd->nxtx)+sizeof(struct q_xtnt_header),fd->xmap[i+1].size);
+}
+
 /* advance fd so that xpos is *inside* extent (except at EOF) */
 int qnx_advance_xtnt(qnx_file *fd)
 {
@@ -174,7 +717,9 @@ int qnx_advance_xtnt(qnx_file *fd)
 			break;
 
 		fd->xpos -= fd->xsize;
-		if(qnx_set_fd_xtnt(fd,fd->nxtx))
+		if(fd->xmap!=NULL)	/* nxtx!=0 means there is a next entry */
+			qnx_set_fd_xidx(fd,fd->xidx+1);
+		else if(qnx_set_fd_xtnt(fd,fd->nxtx))
 		{
 			fd->iflags |= QIF_ERR;
 			func_abort("Can't read extent %d",fd->nxtx);
@@ -192,17 +737,96 @@ int qnx_advance_xtnt(qnx_file *fd)
 	return 0;
 }
 
+/* walk the extent chain once and keep (file offset, block, size) for
+ * each extent, so seeks don't have to re-read headers; no qd_prefetch
+ * here: the next header is only known once the current one is read, and
+ * it is read straight away, so a hint can't get ahead of the read */
+int qnx_build_xmap(qnx_file *fd)
+{
+	qnx_xmap *m=NULL,*nm;
+	uint32_t n=0,cap=0;
+	uint32_t foff=0;
+	uint32_t bn=fd->firstx;
+	uint32_t maxx=MIN(fd->qd->isize/Q_BLOCKSIZE,UINT32_MAX);	/* can't have more extents than blocks */
+	struct q_xtnt_header h;
+
+	while(bn)
+	{
+		if(n>=maxx)
+		{
+			free(m);
+			func_abort("extent chain starting at %u loops",fd->firstx);
+		}
+		if(qnx_read_xh(fd->qd,bn,&h))
+		{
+			free(m);
+			func_abort("Can't read extent %u",bn);
+		}
+		if(n==cap)
+		{
+			cap=cap ? cap*2 : 8;
+			nm=realloc(m,cap*sizeof(qnx_xmap));
+			if(nm==NULL)
+			{
+				free(m);
+				func_abort("alloc error!");
+			}
+			m=nm;
+		}
+		if(qnx_check_xh(fd->qd,bn,&h))
+		{
+			free(m);
+			return -1;
+		}
+		m[n].foff=foff;
+		m[n].bn=bn;
+		m[n].size=h.size_xtnt;
+		foff+=h.size_xtnt;
+		n++;
+		bn=h.next_xtnt;
+	}
+	free(fd->xmap);
+	fd->xmap=m;
+	fd->nxmap=n;
+	return 0;
+}
+
 int32_t qnx_seek(qnx_file *fd, int32_t offset)
 {
+	uint32_t lo,hi,mid;
+
 	if(fd->iflags & QIF_ERR)
 		func_abort("internal file state bad");
-	if(qnx_set_fd_xtnt(fd,fd->firstx))
+
+	if(fd->xmap==NULL && qnx_build_xmap(fd))
+		func_msg("no extent map for %u, walking extent chain",fd->firstx);
+
+	if(fd->xmap!=NULL && fd->nxmap)
 	{
-		fd->iflags |= QIF_ERR;
-		func_abort("error reading first xtnt (%u)\n",fd->firstx);
+		/* last extent starting at or before offset */
+		lo=0;
+		hi=fd->nxmap-1;
+		while(lo<hi)
+		{
+			mid=(lo+hi+1)/2;
+			if(fd->xmap[mid].foff <= (uint32_t)offset)
+				lo=mid;
+			else
+				hi=mid-1;
+		}
+		qnx_set_fd_xidx(fd,lo);
+		fd->xpos=offset-fd->xmap[lo].foff;
+	}
+	else
+	{
+		if(qnx_set_fd_xtnt(fd,fd->firstx))
+		{
+			fd->iflags |= QIF_ERR;
+			func_abort("error reading first xtnt (%u)\n",fd->firstx);
+		}
+		fd->xpos=offset;
 	}
 	fd->iflags &= ~QIF_ATEOF;
-	fd->xpos=offset;
 	fd->fpos=offset;
 	if(qnx_advance_xtnt(fd))
 		return -1;
@@ -229,7 +853,7 @@ int32_t qnx_read(qnx_file *fd, void *buf, uint32_t count)
 	rb=count;
 	do
 	{
-		rr=qnx_read_xtnt_data(fd->qd,fd->crtx,fd->xpos,dbuf,rb);
+		rr=qnx_read_fd_xtnt(fd,dbuf,rb);
 		if(rr<0)	/* something went wrong */
 		{
 			if(rb!=count)	/* did we read anything? */
@@ -249,17 +873,46 @@ int32_t qnx_read(qnx_file *fd, void *buf, uint32_t count)
 	return count-rb;
 }
 
-/* calculate file size */
-int32_t qnx_filesize(qnx_disk *qd, struct q_dir_entry *de)
+/* file size from directory entry - QNX 2.x only */
+static int32_t qnx_fsize_dirent(qnx_disk *qd, struct q_dir_entry *de)
+{
+	int64_t l=(int64_t)(1+de->fnum_blks)*Q_BLOCKSIZE - de->fnum_chars_free;
+
+	/* sanity checks, in case this isn't really a 2.x entry */
+	if(de->fnum_blks<0 || de->fnum_chars_free>Q_BLOCKSIZE || l<0 || l>(int64_t)qd->isize)
+		return -1;
+	return l;
+}
+
+/* single-extent file: one header read (first == last extent) */
+static int32_t qnx_fsize_lastx(qnx_disk *qd, struct q_dir_entry *de)
+{
+	struct q_xtnt_header h;
+
+	if(de->fnum_xtnt!=1 || de->ffirst_xtnt!=de->flast_xtnt)
+		return -1;
+	if(qnx_read_xh(qd,de->flast_xtnt,&h))
+		func_abort("Can't read extent %u",de->flast_xtnt);
+	if(h.prev_xtnt || h.next_xtnt || qnx_check_xh(qd,de->flast_xtnt,&h))
+		return -1;	/* header doesn't agree with directory entry */
+	return h.size_xtnt;
+}
+
+/* walk the whole chain (not prefetched, see qnx_build_xmap) */
+static int32_t qnx_fsize_chain(qnx_disk *qd, struct q_dir_entry *de)
 {
 	int32_t l=0;
 	uint32_t cbn;
+	uint32_t n=0;
+	uint32_t maxx=MIN(qd->isize/Q_BLOCKSIZE,UINT32_MAX);
 	struct q_xtnt_header h;
 
 	cbn=de->ffirst_xtnt;
 	
 	while(cbn)
 	{
+		if(n++>=maxx)
+			func_abort("extent chain starting at %u loops",de->ffirst_xtnt);
 		if(qnx_read_xh(qd,cbn,&h))
 			func_abort("Can't read extent %u",cbn);
 		cbn=h.next_xtnt;
@@ -268,6 +921,59 @@ int32_t qnx_filesize(qnx_disk *qd, struct q_dir_entry *de)
 	return l;
 }
 
+int32_t qnx_filesize_s(qnx_disk *qd, struct q_dir_entry *de, int st)
+{
+	uint32_t bn=de->ffirst_xtnt;
+	uint32_t mi=bn%QSZ_MEMO;
+	int32_t l=-1;
+
+	switch(st)
+	{
+		case QSZ_DIRENT:
+			return qnx_fsize_dirent(qd,de);
+		case QSZ_LASTX:
+			return qnx_fsize_lastx(qd,de);
+		case QSZ_CHAIN:
+			return qnx_fsize_chain(qd,de);
+		case QSZ_AUTO:
+			break;
+		default:
+			func_abort("unknown size strategy %d",st);
+	}
+
+	if(bn)
+	{
+		pthread_mutex_lock(&qd->lock);
+		if(qd->szmemo[mi].bn==bn)
+			l=qd->szmemo[mi].size;
+		pthread_mutex_unlock(&qd->lock);
+		if(l>=0)
+			return l;
+	}
+
+	if(qd->oflags & QDO_QNX2)
+		l=qnx_fsize_dirent(qd,de);
+	if(l<0)
+		l=qnx_fsize_lastx(qd,de);
+	if(l<0)
+		l=qnx_fsize_chain(qd,de);
+
+	if(l>=0 && bn)
+	{
+		pthread_mutex_lock(&qd->lock);
+		qd->szmemo[mi].bn=bn;
+		qd->szmemo[mi].size=l;
+		pthread_mutex_unlock(&qd->lock);
+	}
+	return l;
+}
+
+/* calculate file size */
+int32_t qnx_filesize(qnx_disk *qd, struct q_dir_entry *de)
+{
+	return qnx_filesize_s(qd,de,QSZ_AUTO);
+}
+
 /* open helper */
 int qnx_de2fd(qnx_disk *qd,struct q_dir_entry *de,qnx_file *fd)
 {
@@ -281,10 +987,8 @@ int qnx_de2fd(qnx_disk *qd,struct q_dir_entry *de,qnx_file *fd)
 	fd->qd = qd;
 	fd->attrs = de->fattr;
 	fd->firstx = de->ffirst_xtnt;
-	fd->fsize = fsize;
-	/* commented fd->fsize line below would probably work on QNX 2.x */
-/*	fd->fsize=(1+de->fnum_blks)*Q_BLOCKSIZE - de->fnum_chars_free; */
-	
+	fd->fsize = fsize;	/* see qnx_filesize_s for QNX 2.x sizes */
+
 	/* set extent variables in our struct */
 	if(qnx_set_fd_xtnt(fd, de->ffirst_xtnt))
 		func_abort("unable to read first extent");
@@ -311,36 +1015,321 @@ int qnx_dir_nextentry(qnx_file *fd, struct q_dir_entry *d)
 	return 1;
 }
 
+/* bulk directory iterator */
+int qnx_diter_init(qnx_diter *it, qnx_file *fd)
+{
+	memset(it,0,sizeof(qnx_diter));
+	if(!(fd->attrs & QFA_DIRECTORY) || (fd->iflags & QIF_ERR))
+		return -1;
+	if(fd->xmap==NULL && qnx_build_xmap(fd))
+		return -1;
+	it->fd=fd;
+	it->rem=fd->fsize;
+	it->skip=sizeof(struct q_dir_cont);
+	return 0;
+}
+
+/* prefetch the next directory extent and, with it->pfent, the first extent
+ * (header and start of data) of each entry now in buf */
+static void qnx_diter_prefetch(qnx_diter *it)
+{
+	qnx_file *fd=it->fd;
+	struct q_dir_entry *de;
+	uint32_t p;
+
+	if(!(fd->qd->oflags & QDO_PREFETCH))
+		return;
+	if(it->rem && it->xi<fd->nxmap)
+		qd_prefetch(fd->qd,QBN2OFF(fd->xmap[it->xi].bn),sizeof(struct q_xtnt_header)+MIN(fd->xmap[it->xi].size,it->rem));
+	for(p=it->pos;it->pfent && p+sizeof(struct q_dir_entry)<=it->len;p+=sizeof(struct q_dir_entry))
+	{
+		de=(struct q_dir_entry *)(it->buf+p);
+		if(de->fname[0] && de->ffirst_xtnt>0)
+			qd_prefetch(fd->qd,QBN2OFF(de->ffirst_xtnt),sizeof(struct q_xtnt_header)+QPF_FIRST);
+	}
+}
+
+/* load next extent after what's left in buf; returns 0 if something was added */
+static int qnx_diter_fill(qnx_diter *it)
+{
+	qnx_file *fd=it->fd;
+	uint32_t left=it->len-it->pos;
+	uint32_t xs;
+	uint8_t *nb;
+
+	while(it->rem && it->xi<fd->nxmap)
+	{
+		xs=MIN(fd->xmap[it->xi].size,it->rem);
+		if(left+xs > it->cap)
+		{
+			if((nb=realloc(it->buf,left+xs))==NULL)
+				func_abort("alloc error!");
+			it->buf=nb;
+			it->cap=left+xs;
+		}
+		memmove(it->buf,it->buf+it->pos,left);
+		if(qd_read(fd->qd,it->buf+left,QBN2OFF(fd->xmap[it->xi].bn)+sizeof(struct q_xtnt_header),xs))
+			func_abort("can't read directory extent %u",fd->xmap[it->xi].bn);
+		it->xi++;
+		it->rem-=xs;
+		it->len=left+xs;
+		it->pos=MIN(it->skip,it->len);
+		it->skip-=it->pos;
+		qnx_diter_prefetch(it);
+		if(it->len-it->pos)
+			return 0;
+		left=0;
+	}
+	return 1;
+}
+
+struct q_dir_entry *qnx_diter_next(qnx_diter *it)
+{
+	struct q_dir_entry *de;
+
+	if(it->fd==NULL)
+		return NULL;
+	for(;;)
+	{
+		while(it->len-it->pos < sizeof(struct q_dir_entry))
+			if(qnx_diter_fill(it))
+				return NULL;
+		de=(struct q_dir_entry *)(it->buf+it->pos);
+		it->pos+=sizeof(struct q_dir_entry);
+		if(de->fname[0])
+			return de;
+	}
+}
+
+void qnx_diter_close(qnx_diter *it)
+{
+	free(it->buf);
+	memset(it,0,sizeof(qnx_diter));
+}
+
+/* directory hash tables */
+static void qnx_dh_free(qd_dirhash *h)
+{
+	free(h->ent);
+	free(h->slot);
+	memset(h,0,sizeof(qd_dirhash));
+}
+
+int qd_dirhash_init(qnx_disk *qd, uint32_t ndirs)
+{
+	uint32_t i;
+
+	for(i=0;i<qd->ndhash;i++)
+		qnx_dh_free(&qd->dhash[i]);
+	free(qd->dhash);
+	qd->dhash=NULL;
+	qd->ndhash=qd->dhnext=0;
+	if(!ndirs)
+		return 0;
+	if((qd->dhash=calloc(ndirs,sizeof(qd_dirhash)))==NULL)
+		func_abort("alloc error!");
+	qd->ndhash=ndirs;
+	return 0;
+}
+
+/* hash of name as compared by qnx_search_dir (at most QNX_MAXFNLEN+1 chars) */
+static uint32_t qnx_name_hash(const uint8_t *name)
+{
+	uint32_t h=2166136261u;
+	int i;
+	for(i=0;i<=QNX_MAXFNLEN && name[i];i++)
+		h=(h^name[i])*16777619u;
+	return h;
+}
+
+/* probe h for name; copies entry to dde. returns 0 if found, 1 if not */
+static int qnx_dh_find(qd_dirhash *h, char *name, struct q_dir_entry *dde)
+{
+	uint32_t i,e;
+
+	for(i=qnx_name_hash((uint8_t *)name)&h->mask;(e=h->slot[i]);i=(i+1)&h->mask)
+		if(strncmp((char *)h->ent[e-1].fname,name,sizeof(h->ent[e-1].fname))==0)
+		{
+			memcpy(dde,&h->ent[e-1],sizeof(struct q_dir_entry));
+			return 0;
+		}
+	return 1;
+}
+
+/* read whole directory fd into h (hashed only if it has QDH_MIN entries) */
+static int qnx_dh_build(qnx_file *fd, qd_dirhash *h)
+{
+	struct q_dir_entry *de,*ne;
+	qnx_diter it;
+	uint32_t cap=0,ns,i,j;
+
+	memset(h,0,sizeof(qd_dirhash));
+	if(qnx_diter_init(&it,fd))
+		return -1;
+	while((de=qnx_diter_next(&it))!=NULL)
+	{
+		if(h->nent==cap)
+		{
+			cap=cap ? cap*2 : 64;
+			if((ne=realloc(h->ent,cap*sizeof(struct q_dir_entry)))==NULL)
+			{
+				qnx_diter_close(&it);
+				qnx_dh_free(h);
+				func_abort("alloc error!");
+			}
+			h->ent=ne;
+		}
+		memcpy(&h->ent[h->nent++],de,sizeof(struct q_dir_entry));
+	}
+	qnx_diter_close(&it);
+	if(h->nent<QDH_MIN)
+		return 0;
+
+	for(ns=2;ns<2*h->nent;ns<<=1);
+	if((h->slot=calloc(ns,sizeof(uint32_t)))==NULL)
+		return 0;	/* linear search still works */
+	h->mask=ns-1;
+	for(i=0;i<h->nent;i++)
+	{
+		/* keep first of duplicate names, like the linear search */
+		for(j=qnx_name_hash(h->ent[i].fname)&h->mask;h->slot[j];j=(j+1)&h->mask)
+			if(strncmp((char *)h->ent[h->slot[j]-1].fname,(char *)h->ent[i].fname,sizeof(h->ent[i].fname))==0)
+				break;
+		if(!h->slot[j])
+			h->slot[j]=i+1;
+	}
+	h->dbn=fd->firstx;
+	return 0;
+}
+
 /* search directory */
 int qnx_search_dir(qnx_file *fd, char *name, struct q_dir_entry *dde)
 {
-	struct q_dir_entry de;
+	qnx_disk *qd=fd->qd;
+	struct q_dir_entry *de;
+	qnx_diter it;
+	qd_dirhash h;
+	uint32_t i;
+	int r=-1;
+
+	/* hashed: probe existing table, or build one for this directory */
+	if(qd->ndhash && fd->firstx && (fd->attrs & QFA_DIRECTORY) && !(fd->iflags & QIF_ERR))
+	{
+		pthread_mutex_lock(&qd->lock);
+		for(i=0;i<qd->ndhash;i++)
+			if(qd->dhash[i].dbn==fd->firstx)
+			{
+				r=qnx_dh_find(&qd->dhash[i],name,dde);
+				break;
+			}
+		pthread_mutex_unlock(&qd->lock);
+		if(r>=0)
+			return r;
+
+		if(qnx_dh_build(fd,&h))
+			return -1;
+		if(h.slot!=NULL)
+		{
+			r=qnx_dh_find(&h,name,dde);
+			pthread_mutex_lock(&qd->lock);
+			i=qd->dhnext;
+			qd->dhnext=(i+1)%qd->ndhash;
+			qnx_dh_free(&qd->dhash[i]);
+			qd->dhash[i]=h;
+			pthread_mutex_unlock(&qd->lock);
+			return r;
+		}
+		/* small directory - search the entries we already have */
+		r=1;
+		for(i=0;i<h.nent;i++)
+			if(strncmp((char *)h.ent[i].fname,name,sizeof(h.ent[i].fname))==0)
+			{
+				memcpy(dde,&h.ent[i],sizeof(struct q_dir_entry));
+				r=0;
+				break;
+			}
+		qnx_dh_free(&h);
+		return r;
+	}
 
 	/* don't do anything if not a directory or if internal flag QIF_ERR is SET */
-	if(!(fd->attrs & QFA_DIRECTORY) || (fd->iflags & (QIF_ERR|QIF_ATEOF)))
+	if(qnx_diter_init(&it,fd))
 		return -1;
 
-	qnx_dir_init(fd);
-	while(qnx_dir_nextentry(fd,&de)==0)
+	while((de=qnx_diter_next(&it))!=NULL)
 	{
-		if(strncmp((char *)de.fname,name,sizeof(de.fname))==0)
+		if(strncmp((char *)de->fname,name,sizeof(de->fname))==0)
 		{
-			memcpy(dde,&de,sizeof(struct q_dir_entry));
+			memcpy(dde,de,sizeof(struct q_dir_entry));
+			qnx_diter_close(&it);
 			return 0;
 		}
 	}
+	qnx_diter_close(&it);
 	return 1;
 }
 
+/* dentry cache slot for name in directory pbn */
+static uint32_t qnx_dc_slot(uint32_t pbn, uint8_t *name)
+{
+	return (qnx_name_hash(name)^(pbn*2654435761u))%QDC_SIZE;
+}
+
+int qnx_lookup(qnx_file *fd, char *name, struct q_dir_entry *dde)
+{
+	qnx_disk *qd=fd->qd;
+	uint8_t key[QNX_MAXFNLEN+1];
+	qd_dentry *c;
+	int r=-2;
+
+	/* longer names can't be cached (strncmp in qnx_search_dir ignores the rest) */
+	if(qd->dcache==NULL || !fd->firstx || strlen(name)>QNX_MAXFNLEN+1)
+		return qnx_search_dir(fd,name,dde);
+
+	memset(key,0,sizeof(key));
+	strncpy((char *)key,name,sizeof(key));
+	c=&qd->dcache[qnx_dc_slot(fd->firstx,key)];
+
+	pthread_mutex_lock(&qd->lock);
+	if(c->pbn==fd->firstx && !memcmp(c->name,key,sizeof(key)))
+	{
+		if(c->neg)
+			r=1;
+		else
+		{
+			memcpy(dde,&c->de,sizeof(struct q_dir_entry));
+			r=0;
+		}
+	}
+	pthread_mutex_unlock(&qd->lock);
+	if(r!=-2)
+		return r;
+
+	r=qnx_search_dir(fd,name,dde);
+	if(r>=0)	/* don't remember errors */
+	{
+		pthread_mutex_lock(&qd->lock);
+		c->pbn=fd->firstx;
+		memcpy(c->name,key,sizeof(key));
+		c->neg=r;
+		if(!r)
+			memcpy(&c->de,dde,sizeof(struct q_dir_entry));
+		pthread_mutex_unlock(&qd->lock);
+	}
+	return r;
+}
+
 /* open file from (absolute) path */
 int q_open_file(qnx_disk *qd, char *path, qnx_file *fd)
 {
 	char *tp;
 	char *crtt;
+	char *sp;	/* strtok_r state */
 	int r=-1;
 	struct q_dir_entry de;
 	qnx_file tfd;
 
+	memset(&tfd,0,sizeof(qnx_file));
 	tp=strdup(path);
 	if(tp==NULL)
 		func_abort("alloc error!");
@@ -351,21 +1340,22 @@ int q_open_file(qnx_disk *qd, char *path, qnx_file *fd)
 		goto eofunc;
 	}
 	
-	crtt=strtok(tp,"/");
+	crtt=strtok_r(tp,"/",&sp);
 
 	while(crtt!=NULL)
 	{
-		if(qnx_search_dir(&tfd,crtt,&de))
+		if(qnx_lookup(&tfd,crtt,&de))
 		{
 			func_msg("Path component %s not found\n",crtt);
 			goto eofunc;
 		}
+		qnx_close(&tfd);
 		if(qnx_de2fd(qd,&de,&tfd))
 		{
 			fprintf(stderr,"Unable to open path component %s\n",crtt);
 			goto eofunc;
 		}
-		crtt=strtok(NULL,"/");
+		crtt=strtok_r(NULL,"/",&sp);
 		if(crtt!=NULL && !(tfd.attrs & QFA_DIRECTORY))
 		{
 			fprintf(stderr,"%s: not a directory\n",de.fname);
@@ -376,6 +1366,27 @@ int q_open_file(qnx_disk *qd, char *path, qnx_file *fd)
 	r=0;
 
 eofunc:
+	if(r)
+		qnx_close(&tfd);
 	free(tp);
 	return r;
 }
+
+int qnx_close(qnx_file *fd)
+{
+	free(fd->xmap);
+	fd->xmap=NULL;
+	fd->nxmap=0;
+	return 0;
+}
+
+int q_strtonum(const char *s, uint64_t max, uint64_t *v)
+{
+	char *ep;
+
+	if(*s<'0' || *s>'9')	/* no sign or blanks, strtoull would take them */
+		return -1;
+	errno=0;
+	*v=strtoull(s,&ep,10);
+	return (errno || *ep || *v>max) ? -1 : 0;
+}
@@ -23,10 +23,40 @@
 
 /* definitions required for qnx filesystem access */
 
+#include <pthread.h>
+
 #define Q_BLOCKSIZE 512
 
 #define QNX_MAXFNLEN 16	/* see direntry */
 
+/* byte offset (into partition) of 1-based block bn - 64 bit, so that
+ * partitions/images above 4GB work */
+#define QBN2OFF(bn) ((uint64_t)((bn)-1)*Q_BLOCKSIZE)
+
+/* qd_open flags */
+#define QDO_MMAP	1<<0	/* map image into memory instead of using read(2) */
+#define QDO_QNX2	1<<1	/* QNX 2.x image: directory entry sizes can be trusted */
+#define QDO_GZIDX	1<<2	/* compressed image: keep its seek index in <image>.gzi */
+#define QDO_NORAW	1<<3	/* (set by qd_open) not a plain image (compressed, IMD...),
+							 * fd data can't be used directly */
+#define QDO_PREFETCH	1<<4	/* hint upcoming extent reads to the OS (see qd_prefetch) */
+
+/* file size strategies (qnx_filesize_s) */
+#define QSZ_AUTO	0	/* cheapest valid method below, chain walk as fallback */
+#define QSZ_DIRENT	1	/* fnum_blks/fnum_chars_free from dir entry (QNX 2.x) */
+#define QSZ_LASTX	2	/* single header read, only for single-extent files */
+#define QSZ_CHAIN	3	/* walk and sum the whole extent chain */
+
+#define QSZ_MEMO	512	/* file size memo entries (direct-mapped) */
+
+#define QDC_SIZE	1024	/* path component (dentry) cache entries (direct-mapped) */
+#define QC_MAXSLOTS	(1<<21)	/* sector cache slots accepted on the command line (1GB) */
+
+#define QDH_MIN		32		/* directories with fewer entries are not hashed */
+
+#define QPF_RING	64		/* outstanding prefetch ranges remembered (for qd_pfstat) */
+#define QPF_FIRST	4096	/* bytes prefetched from the first extent of directory entries */
+
 /* internal flags (i.e. related to qnx_acc functions)) */
 #define QIF_ATEOF	1<<0
 #define QIF_ERR		1<<1
@@ -91,6 +121,16 @@ struct q_dir_cont
 	struct q_dir_entry de[];
 };
 
+struct q_mbr_part	/* PC partition table entry */
+{
+	uint8_t boot;
+	uint8_t chs_first[3];
+	uint8_t type;
+	uint8_t chs_last[3];
+	uint32_t lba;		/* first sector */
+	uint32_t nsect;		/* number of sectors */
+};
+
 struct q_block1	/* superblock */
 {
 	struct q_xtnt_header header;
@@ -104,14 +144,140 @@ struct q_block1	/* superblock */
 
 /* internal structures used by the qnx_acc functions */
 
-typedef struct qnx_disk
+/* sector cache: fixed arena of Q_BLOCKSIZE slots, hashed by sector number,
+ * CLOCK (second chance) eviction */
+typedef struct qd_cache
+{
+	uint32_t nslots;		/* 0 = cache disabled */
+	uint32_t hmask;			/* hash buckets - 1 (power of 2) */
+	uint8_t *arena;			/* nslots * Q_BLOCKSIZE */
+	uint32_t *ssn;			/* sector held by each slot (QC_EMPTY if none) */
+	uint32_t *snext;		/* next slot in same bucket (QC_EMPTY ends chain) */
+	uint32_t *bucket;		/* first slot in bucket */
+	uint8_t *ref;			/* CLOCK reference bits */
+	uint32_t hand;			/* CLOCK hand */
+	uint32_t hits;
+	uint32_t misses;
+} qd_cache;
+
+#define QC_EMPTY 0xffffffff
+
+/* path component cache entry: name in directory starting at pbn */
+typedef struct qd_dentry
+{
+	uint32_t pbn;		/* parent first extent (0 = unused entry) */
+	uint8_t name[QNX_MAXFNLEN+1];
+	uint8_t neg;		/* name known not to exist in parent */
+	struct q_dir_entry de;
+} qd_dentry;
+
+/* hash table of a (large) directory, open addressing */
+typedef struct qd_dirhash
+{
+	uint32_t dbn;		/* directory first extent (0 = unused) */
+	uint32_t nent;
+	uint32_t mask;		/* slots - 1 (power of 2) */
+	struct q_dir_entry *ent;
+	uint32_t *slot;		/* entry index + 1, 0 = empty */
+} qd_dirhash;
+
+struct qd_image;
+
+/* image backend (container format): everything below qnx_disk reads the
+ * image as a flat sequence of bytes through read */
+typedef struct qd_backend
+{
+	const char *name;
+	int (*probe)(int fd);		/* 1 if the file is in this format */
+	/* sets img->isize (image size as seen by qnx_disk), img->priv and, if
+	 * the image is plain bytes, img->map; oflags are the qd_open flags */
+	int (*open)(struct qd_image *img, const char *path, int oflags);
+	int (*read)(struct qd_image *img, void *buf, uint64_t off, uint32_t count);
+	void (*close)(struct qd_image *img);	/* doesn't close fd */
+	/* optional (NULL): start reading count bytes at off in the background */
+	void (*prefetch)(struct qd_image *img, uint64_t off, uint32_t count);
+} qd_backend;
+
+extern const qd_backend qd_raw_backend;
+
+/* image file, shared by the qnx_disk views of its partitions */
+typedef struct qd_image
 {
 	int fd;
-	char sbuf[Q_BLOCKSIZE];	/* sector buffer */
-	size_t isize;			/* image size */
-	uint32_t ioff;			/* image offset, used to read partitions */
+	uint64_t isize;
+	uint8_t *map;		/* whole image mapped (plain images only) or NULL */
+	const qd_backend *be;
+	void *priv;			/* backend state */
+	int refs;			/* number of qnx_disk using it */
+	pthread_mutex_t lock;
+	uint64_t nsys;		/* image reads and hints (pread, fadvise, madvise) */
+	uint64_t nbytes;	/* bytes read by them (statistics for benchmarks) */
+} qd_image;
+
+/* prefetch counters (QDO_PREFETCH); a read is a hit if it falls entirely
+ * inside a range prefetched earlier */
+typedef struct qd_pfstat
+{
+	uint64_t issued;	/* prefetch requests passed to the OS */
+	uint64_t bytes;		/* ...and their total size */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t unused;	/* ranges dropped from the ring without a hit */
+} qd_pfstat;
+
+/* partition table entry, see qd_read_parts */
+typedef struct qd_part
+{
+	int num;			/* 1-4 primary, 5+ logical (same as Linux/fdisk) */
+	uint8_t type;
+	uint64_t start;		/* offset in image (bytes) */
+	uint64_t size;		/* bytes */
+} qd_part;
+
+#define QD_MAXLOGICAL	60	/* follow at most this many extended partition links */
+#define QD_ISQNXPART(t)	((t)==0x4d || (t)==0x4e || (t)==0x4f)
+#define QD_ISEXTPART(t)	((t)==0x05 || (t)==0x0f || (t)==0x85)
+
+/* all qd_ and qnx_ read functions can be called concurrently on the same
+ * qnx_disk (pread, no shared buffers); a qnx_file belongs to one thread */
+typedef struct qnx_disk
+{
+	qd_image *img;
+	int fd;					/* these three are copies of img fields; */
+							/* fd is the container file if QDO_NORAW */
+	pthread_mutex_t lock;	/* protects cache, szmemo, dcache, dhash and pf* */
+	uint64_t isize;			/* image size (end of partition, for views) */
+	uint64_t ioff;			/* image offset, used to read partitions */
+	int oflags;				/* QDO_* flags given to qd_open */
+	uint8_t *map;			/* whole image mapping (QDO_MMAP) or NULL */
+	qd_cache cache;			/* sector cache (see qd_cache_init) */
+	struct
+	{
+		uint32_t bn;		/* first extent (0 = unused) */
+		int32_t size;
+	} szmemo[QSZ_MEMO];		/* file sizes by first extent */
+	qd_dentry *dcache;		/* path component cache (QDC_SIZE) or NULL */
+	qd_dirhash *dhash;		/* directory hash tables (see qd_dirhash_init) */
+	uint32_t ndhash;
+	uint32_t dhnext;		/* next table to replace (round robin) */
+	struct
+	{
+		uint64_t off;		/* absolute image offset */
+		uint32_t len;		/* 0 = unused slot */
+		uint32_t hit;
+	} pfring[QPF_RING];		/* recent prefetch ranges (QDO_PREFETCH) */
+	uint32_t pfnext;
+	qd_pfstat pf;
 } qnx_disk;
 
+/* extent map entry - one per extent, sorted by foff */
+typedef struct qnx_xmap
+{
+	uint32_t	foff;	/* file offset of first byte in extent */
+	uint32_t	bn;		/* block number of extent */
+	uint32_t	size;	/* extent data size (bytes) */
+} qnx_xmap;
+
 typedef struct qnx_file
 {
 	qnx_disk *	qd;
@@ -125,6 +291,9 @@ typedef struct qnx_file
 	uint32_t	nxtx;
 	uint32_t	xpos;	/* position into current extent */
 	uint32_t	xsize;	/* size (in bytes) of current extent */
+	qnx_xmap *	xmap;	/* extent map (built on first seek) or NULL */
+	uint32_t	nxmap;	/* number of entries in xmap */
+	uint32_t	xidx;	/* index of current extent in xmap */
 } qnx_file;
 
 /* function definitions */
@@ -136,16 +305,54 @@ typedef struct qnx_file
 int qd_close(qnx_disk *qd);
 
 /* open disk image at path and fills qd info; ioff is optional offset
- * e.g. for partitions inside hdd images */
-int qd_open(qnx_disk *qd, char *path, uint32_t ioff);
-
-/* (0-based) absolute sector number into buf */
+ * e.g. for partitions inside hdd images; oflags is a combination of QDO_*
+ * (QDO_MMAP falls back to read(2) if the image can't be mapped) */
+int qd_open(qnx_disk *qd, char *path, uint64_t ioff, int oflags);
+
+/* open another view (e.g. a different partition at ioff, size bytes long,
+ * 0 - up to the end) of the image already opened as base; fd and mapping
+ * are shared, caches are not. each view is closed with qd_close, the image
+ * goes with the last one */
+int qd_open_view(qnx_disk *qd, qnx_disk *base, uint64_t ioff, uint64_t size);
+
+/* read PC partition table (MBR and extended partitions) of the image qd
+ * (absolute, ioff is ignored) into p. returns number of entries, 0 if none */
+int qd_read_parts(qnx_disk *qd, qd_part *p, int maxp);
+
+/* enable sector cache with nslots Q_BLOCKSIZE slots (0 disables it)
+ * call after qd_open, before using qd from several threads;
+ * memory is released by qd_close */
+int qd_cache_init(qnx_disk *qd, uint32_t nslots);
+
+/* keep hash tables for up to ndirs large directories (0 disables), used by
+ * qnx_search_dir; same rules as qd_cache_init */
+int qd_dirhash_init(qnx_disk *qd, uint32_t ndirs);
+
+/* (0-based) absolute sector number into buf (through the cache if enabled) */
 int qd_read_sector(qnx_disk *qd, uint32_t sn, void *buf);
 
-/* absolute (byte granularity) read from disk image 
- * (calls qd_read_sector) */
-int32_t qd_read(qnx_disk *qd, void *buf, uint32_t offset, uint32_t count);
+/* n consecutive sectors starting at sn into buf (one pread) */
+int qd_read_sectors(qnx_disk *qd, uint32_t sn, uint32_t n, void *buf);
+
+/* absolute (byte granularity) read from disk image
+ * (aligned middle via qd_read_sectors, head/tail via qd_read_sector) */
+int32_t qd_read(qnx_disk *qd, void *buf, uint64_t offset, uint32_t count);
 
+/* direct pointer to count bytes at offset in a mapped image (QDO_MMAP)
+ * returns NULL if the image is not mapped or the range is outside it */
+const void *qd_map(qnx_disk *qd, uint64_t offset, uint32_t count);
+
+/* with QDO_PREFETCH: tell the OS that count bytes at offset will be read
+ * soon (madvise if mapped, otherwise the backend prefetch, if any);
+ * never fails, does nothing without QDO_PREFETCH */
+void qd_prefetch(qnx_disk *qd, uint64_t offset, uint32_t count);
+
+/* count a read of count bytes at offset made without qd_read (e.g. by
+ * copy_file_range on the image fd) as a prefetch hit or miss */
+void qd_prefetch_used(qnx_disk *qd, uint64_t offset, uint32_t count);
+
+/* copy of the prefetch counters of qd into st */
+void qd_prefetch_stats(qnx_disk *qd, qd_pfstat *st);
 
 /***************
  * extent/data *
@@ -156,19 +363,34 @@ int32_t qd_read(qnx_disk *qd, void *buf, uint32_t offset, uint32_t count);
  * returns number of bytes read or -1 on error */
 int32_t qnx_read_xtnt_data(qnx_disk *qd,uint32_t bn,uint32_t offset,void *buf,uint32_t count);
 
+/* same as qnx_read_xtnt_data, but returns a pointer into the mapped image
+ * instead of copying; *count is trimmed to extent size.
+ * returns NULL on error or if the image is not mapped (use qnx_read_xtnt_data) */
+const void *qnx_map_xtnt_data(qnx_disk *qd,uint32_t bn,uint32_t offset,uint32_t *count);
+
 /* read extent header at block number bn into h */
 int qnx_read_xh(qnx_disk *qd,uint32_t bn,struct q_xtnt_header *h);
 
+/* check that extent data described by h fits inside the image
+ * returns 0 if valid */
+int qnx_check_xh(qnx_disk *qd, uint32_t bn, struct q_xtnt_header *h);
+
 
 /*************
  * directory *
  *************/
 
 /* calculate file size - QNX 1.2 directory entry does not include
- * bytes count, only blocks count, and only counts full blocks */
+ * bytes count, only blocks count, and only counts full blocks
+ * (same as qnx_filesize_s with QSZ_AUTO) */
 int32_t qnx_filesize(qnx_disk *qd, struct q_dir_entry *de);
 
-/* file open helper - initializes fd with file date (mostly from de) */
+/* calculate file size using strategy st (QSZ_*); QSZ_AUTO results are
+ * memoized per first extent. returns size or -1 if st can't be used */
+int32_t qnx_filesize_s(qnx_disk *qd, struct q_dir_entry *de, int st);
+
+/* file open helper - initializes fd with file date (mostly from de)
+ * fd must not hold an extent map (qnx_close it first when reusing) */
 int qnx_de2fd(qnx_disk *qd,struct q_dir_entry *de,qnx_file *fd);
 
 /* open root directory (memory-based buffer access only) */
@@ -181,21 +403,59 @@ int qnx_dir_init(qnx_file *fd);
 /* read next direntry from fd (returns 0 on success) */
 int qnx_dir_nextentry(qnx_file *fd, struct q_dir_entry *d);
 
+/* bulk directory iterator: each directory extent is read once into a buffer
+ * and entries are returned in place (entries with empty names are skipped) */
+typedef struct qnx_diter
+{
+	qnx_file *	fd;
+	uint8_t *	buf;	/* extent data, plus partial entry carried over */
+	uint32_t	cap;	/* allocated size of buf */
+	uint32_t	len;	/* valid bytes in buf */
+	uint32_t	pos;	/* offset of next entry in buf */
+	uint32_t	xi;		/* next extent to load (fd->xmap index) */
+	uint32_t	rem;	/* directory bytes not loaded yet */
+	uint32_t	skip;	/* directory header bytes still to skip */
+	int			pfent;	/* prefetch the first extent of each entry (QDO_PREFETCH;
+						 * set after qnx_diter_init when all entries will be opened) */
+} qnx_diter;
+
+/* prepare it for iterating directory fd (builds fd's extent map) */
+int qnx_diter_init(qnx_diter *it, qnx_file *fd);
+
+/* next entry (valid until the next call) or NULL at end/error */
+struct q_dir_entry *qnx_diter_next(qnx_diter *it);
+
+void qnx_diter_close(qnx_diter *it);
+
 /* search fd (directory) for name. If found, fill dde with its directory entry
+ * (through a hash table of the directory if enabled, see qd_dirhash_init)
  * return 0 if found */
 int qnx_search_dir(qnx_file *fd, char *name, struct q_dir_entry *dde);
 
+/* same as qnx_search_dir, but remembers results (including names that
+ * were not found) in the disk's dentry cache.
+ * returns 0 if found, 1 if not found, -1 on error */
+int qnx_lookup(qnx_file *fd, char *name, struct q_dir_entry *dde);
+
 
 /********
  * file *
  ********/
 
-/* set fd fields corresponding to xtnt at bn */
+/* set fd fields corresponding to xtnt at bn (header is validated here) */
 int qnx_set_fd_xtnt(qnx_file *fd, uint32_t bn);
 
+/* read up to count bytes at xpos from the current extent of fd, trusting
+ * the header data cached by qnx_set_fd_xtnt (no header re-read)
+ * returns number of bytes read or -1 on error */
+int32_t qnx_read_fd_xtnt(qnx_file *fd, void *buf, uint32_t count);
+
 /* advance fd so that xpos is *inside* extent except at EOF */
 int qnx_advance_xtnt(qnx_file *fd);
 
+/* build fd->xmap by walking the extent chain once (called by qnx_seek) */
+int qnx_build_xmap(qnx_file *fd);
+
 /* seek fd to offset (no support for other seek modes)
  * returns resulting offset (can be truncated to file size)
  * or -1 on failure */
@@ -207,3 +467,13 @@ int32_t qnx_read(qnx_file *fd, void *buf, uint32_t count);
 /* open file at path (initializes fd). returns 0 on success */
 int q_open_file(qnx_disk *qd, char *path, qnx_file *fd);
 
+/* release memory held by fd (extent map); fd can be reused afterwards */
+int qnx_close(qnx_file *fd);
+
+/*********
+ * tools *
+ *********/
+
+/* command line number: s must be all decimal digits, at most max.
+ * returns 0 (*v set), or -1 */
+int q_strtonum(const char *s, uint64_t max, uint64_t *v);
@@ -0,0 +1,551 @@
+/* qnx_gz.c - random access to gzip/zlib compressed disk images
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "qnx_acc.h"
+#include "qnx_gz.h"
+
+#define QGZ_CHUNK	65536	/* compressed input buffer */
+#define QGZ_PROBE	4096	/* compressed bytes test-inflated by qgz_probe */
+
+int qgz_probe(int fd)
+{
+	uint8_t *in,*out;
+	z_stream s;
+	ssize_t n;
+	int r,ok;
+
+	in=malloc(QGZ_PROBE);
+	out=malloc(QGZ_WINSIZE);
+	if(in==NULL || out==NULL || (n=pread(fd,in,QGZ_PROBE,0))<3)
+	{
+		free(in);
+		free(out);
+		return 0;
+	}
+	if(in[0]==0x1f && in[1]==0x8b && in[2]==8)	/* gzip, deflate */
+		ok=1;
+	else	/* zlib: deflate, 32K window max, header check */
+		ok=(in[0]&0x0f)==8 && (in[0]>>4)<=7 && !(in[1]&0x20) && !((in[0]*256+in[1])%31);
+
+	/* the zlib header check passes for 1 in 31 (or so) plain images,
+	 * so the start of the stream has to inflate without errors too */
+	memset(&s,0,sizeof(s));
+	if(ok && inflateInit2(&s,47)==Z_OK)
+	{
+		s.next_in=in;
+		s.avail_in=n;
+		do
+		{
+			s.next_out=out;
+			s.avail_out=QGZ_WINSIZE;
+			r=inflate(&s,Z_NO_FLUSH);
+		} while(r==Z_OK && s.avail_in);
+		ok=(r==Z_OK || r==Z_STREAM_END || r==Z_BUF_ERROR);
+		inflateEnd(&s);
+	}
+	else
+		ok=0;
+	free(in);
+	free(out);
+	return ok;
+}
+
+/* add access point at (in,out); win is the circular output buffer, with
+ * left bytes unused after the current position */
+static int qgz_addpoint(qd_gz *gz, uint32_t *cap, int bits, uint64_t in, uint64_t out,
+	uint32_t left, const uint8_t *win)
+{
+	qgz_point *p;
+
+	if(gz->npts==*cap)
+	{
+		*cap=*cap ? *cap*2 : 8;
+		if((p=realloc(gz->pts,(size_t)*cap*sizeof(qgz_point)))==NULL)
+			func_abort("alloc error!");
+		gz->pts=p;
+	}
+	p=gz->pts+gz->npts++;
+	p->out=out;
+	p->in=in;
+	p->bits=bits;
+	if(left)
+		memcpy(p->window,win+QGZ_WINSIZE-left,left);
+	if(left<QGZ_WINSIZE)
+		memcpy(p->window+left,win,QGZ_WINSIZE-left);
+	return 0;
+}
+
+/* decompress everything once, noting access points at block boundaries.
+ * concatenated gzip members are handled (a point is forced at the start
+ * of each one) */
+static int qgz_build(qd_gz *gz)
+{
+	z_stream s;
+	uint8_t *in,*win;
+	uint64_t totin=0,totout=0,last=0;
+	uint64_t rpos=0;
+	uint32_t cap=0;
+	ssize_t n;
+	int force=1,rv=-1;
+	int r;
+
+	in=malloc(QGZ_CHUNK);
+	win=calloc(1,QGZ_WINSIZE);
+	memset(&s,0,sizeof(s));
+	if(in==NULL || win==NULL || inflateInit2(&s,47)!=Z_OK)	/* gzip or zlib */
+	{
+		free(in);
+		free(win);
+		func_abort("can't initialize inflate");
+	}
+	s.avail_out=0;
+	for(;;)
+	{
+		if(!s.avail_in)
+		{
+			if((n=pread(gz->fd,in,QGZ_CHUNK,rpos))<0)
+			{
+				func_msg("read error at %" PRIu64,rpos);
+				goto eofunc;
+			}
+			if(!n)
+			{
+				func_msg("unexpected end of compressed data");
+				goto eofunc;
+			}
+			rpos+=n;
+			s.avail_in=n;
+			s.next_in=in;
+		}
+		do
+		{
+			if(!s.avail_out)
+			{
+				s.avail_out=QGZ_WINSIZE;
+				s.next_out=win;
+			}
+			totin+=s.avail_in;
+			totout+=s.avail_out;
+			r=inflate(&s,Z_BLOCK);
+			totin-=s.avail_in;
+			totout-=s.avail_out;
+			if(r!=Z_OK && r!=Z_STREAM_END && r!=Z_BUF_ERROR)
+			{
+				func_msg("corrupted compressed data at %" PRIu64 " (%s)",totin,s.msg ? s.msg : "?");
+				goto eofunc;
+			}
+			if(r==Z_STREAM_END)
+				break;
+			/* end of a block, but not of the last one */
+			if((s.data_type & 128) && !(s.data_type & 64) && (force || totout-last>=QGZ_SPAN))
+			{
+				if(qgz_addpoint(gz,&cap,s.data_type & 7,totin,totout,s.avail_out,win))
+					goto eofunc;
+				last=totout;
+				force=0;
+			}
+		} while(s.avail_in);
+
+		if(r==Z_STREAM_END)
+		{
+			/* another gzip member following? (anything else is ignored);
+			 * its magic may straddle the end of the buffer */
+			if(s.avail_in<2)
+			{
+				if(s.avail_in)
+					memmove(in,s.next_in,s.avail_in);
+				s.next_in=in;
+				if((n=pread(gz->fd,in+s.avail_in,QGZ_CHUNK-s.avail_in,rpos))>0)
+				{
+					rpos+=n;
+					s.avail_in+=n;
+				}
+			}
+			if(s.avail_in<2 || s.next_in[0]!=0x1f || s.next_in[1]!=0x8b)
+				break;
+			inflateReset(&s);
+			force=1;
+		}
+	}
+	if(!gz->npts)	/* empty stream */
+	{
+		func_msg("no data in compressed image");
+		goto eofunc;
+	}
+	gz->usize=totout;
+	rv=0;
+eofunc:
+	inflateEnd(&s);
+	free(in);
+	free(win);
+	return rv;
+}
+
+/* access points that can't come from qgz_build (damaged or foreign index) */
+static int qgz_check(qd_gz *gz, uint64_t csize, uint64_t usize)
+{
+	qgz_point *p;
+	uint64_t end;
+	uint32_t i;
+
+	if(!usize)
+		return -1;
+	for(i=0;i<gz->npts;i++)
+	{
+		p=gz->pts+i;
+		end=(i+1<gz->npts) ? p[1].out : usize;
+		if(p->bits<0 || p->bits>7 || p->in>csize || (p->bits && !p->in) || p->out>=usize)
+			return -1;
+		if(end<=p->out || end-p->out>UINT32_MAX)	/* span length (qgz_get_span) */
+			return -1;
+		if(i+1<gz->npts && p[1].in<=p->in)
+			return -1;
+	}
+	return 0;
+}
+
+static int qgz_load(qd_gz *gz, const char *ipath, struct stat *cs)
+{
+	struct qgz_header h;
+	struct stat is;
+	size_t pl;
+	int fd;
+
+	if((fd=open(ipath,O_RDONLY))<0)
+		return 1;
+	if(read(fd,&h,sizeof(h))!=sizeof(h) || memcmp(h.magic,QGZ_MAGIC,8) || h.version!=QGZ_VERSION ||
+		h.csize!=(uint64_t)cs->st_size || h.mtime!=cs->st_mtime || !h.npts || fstat(fd,&is) ||
+		(uint64_t)is.st_size!=sizeof(h)+(uint64_t)h.npts*sizeof(qgz_point))
+	{
+		close(fd);
+		return 1;	/* stale or not ours, rebuild */
+	}
+	pl=(size_t)h.npts*sizeof(qgz_point);
+	if((gz->pts=malloc(pl))==NULL || read(fd,gz->pts,pl)!=(ssize_t)pl)
+	{
+		free(gz->pts);
+		gz->pts=NULL;
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	gz->npts=h.npts;
+	if(qgz_check(gz,cs->st_size,h.usize))
+	{
+		func_msg("damaged index %s, rebuilding it",ipath);
+		free(gz->pts);
+		gz->pts=NULL;
+		gz->npts=0;
+		return 1;
+	}
+	gz->usize=h.usize;
+	return 0;
+}
+
+static int qgz_save(qd_gz *gz, const char *ipath, struct stat *cs)
+{
+	struct qgz_header h;
+	char *tpath;
+	size_t pl=(size_t)gz->npts*sizeof(qgz_point);
+	int fd,e;
+
+	memset(&h,0,sizeof(h));
+	memcpy(h.magic,QGZ_MAGIC,8);
+	h.version=QGZ_VERSION;
+	h.csize=cs->st_size;
+	h.mtime=cs->st_mtime;
+	h.usize=gz->usize;
+	h.npts=gz->npts;
+
+	/* write to a temporary file, so a reader never sees half an index */
+	if((tpath=malloc(strlen(ipath)+5))==NULL)
+		func_abort("alloc error!");
+	sprintf(tpath,"%s.tmp",ipath);
+	if((fd=open(tpath,O_CREAT | O_TRUNC | O_WRONLY,0644))<0)
+	{
+		free(tpath);
+		func_abort("can't create %s",ipath);
+	}
+	e=write(fd,&h,sizeof(h))!=sizeof(h) || write(fd,gz->pts,pl)!=(ssize_t)pl;
+	if(close(fd) || e || rename(tpath,ipath))
+	{
+		unlink(tpath);
+		free(tpath);
+		func_abort("can't write %s",ipath);
+	}
+	free(tpath);
+	return 0;
+}
+
+qd_gz *qgz_open(int fd, const char *ipath)
+{
+	qd_gz *gz;
+	struct stat s;
+	int i;
+
+	if(fstat(fd,&s))
+	{
+		func_msg("fstat error");
+		return NULL;
+	}
+	if((gz=calloc(1,sizeof(qd_gz)))==NULL)
+	{
+		func_msg("alloc error!");
+		return NULL;
+	}
+	gz->fd=fd;
+	gz->csize=s.st_size;
+	pthread_mutex_init(&gz->lock,NULL);
+	pthread_cond_init(&gz->done,NULL);
+	for(i=0;i<QGZ_NCACHE;i++)
+		gz->span[i].pt=QC_EMPTY;
+
+	if(ipath==NULL || qgz_load(gz,ipath,&s))
+	{
+		if(qgz_build(gz))
+		{
+			qgz_close(gz);
+			return NULL;
+		}
+		if(ipath!=NULL && qgz_save(gz,ipath,&s))
+			func_msg("continuing without saved index");
+	}
+	return gz;
+}
+
+void qgz_close(qd_gz *gz)
+{
+	int i;
+
+	if(gz==NULL)
+		return;
+	for(i=0;i<QGZ_NCACHE;i++)
+		free(gz->span[i].buf);
+	free(gz->pts);
+	pthread_mutex_destroy(&gz->lock);
+	pthread_cond_destroy(&gz->done);
+	free(gz);
+}
+
+/* decompress span starting at point pi into buf (len bytes) */
+static int qgz_inflate_span(qd_gz *gz, uint32_t pi, uint8_t *buf, uint32_t len)
+{
+	qgz_point *p=gz->pts+pi;
+	z_stream s;
+	uint8_t *in;
+	uint64_t rpos;
+	uint8_t b;
+	ssize_t n;
+	int r=Z_OK,rv=-1;
+
+	memset(&s,0,sizeof(s));
+	if((in=malloc(QGZ_CHUNK))==NULL || inflateInit2(&s,-15)!=Z_OK)	/* raw deflate */
+	{
+		free(in);
+		func_abort("can't initialize inflate");
+	}
+	rpos=p->in;
+	if(p->bits)
+	{
+		if(pread(gz->fd,&b,1,p->in-1)!=1)
+		{
+			func_msg("read error at %" PRIu64,p->in-1);
+			goto eofunc;
+		}
+		inflatePrime(&s,p->bits,b>>(8-p->bits));
+	}
+	inflateSetDictionary(&s,p->window,QGZ_WINSIZE);
+
+	s.next_out=buf;
+	s.avail_out=len;
+	while(s.avail_out && r!=Z_STREAM_END)
+	{
+		if(!s.avail_in)
+		{
+			if((n=pread(gz->fd,in,QGZ_CHUNK,rpos))<=0)
+			{
+				func_msg("read error at %" PRIu64,rpos);
+				goto eofunc;
+			}
+			rpos+=n;
+			s.avail_in=n;
+			s.next_in=in;
+		}
+		r=inflate(&s,Z_NO_FLUSH);
+		if(r!=Z_OK && r!=Z_STREAM_END)
+		{
+			func_msg("corrupted compressed data (%s)",s.msg ? s.msg : "?");
+			goto eofunc;
+		}
+	}
+	if(s.avail_out)
+		func_msg("short span %u (%u bytes missing)",pi,s.avail_out);
+	else
+		rv=0;
+eofunc:
+	inflateEnd(&s);
+	free(in);
+	return rv;
+}
+
+/* cached (decompressed) span starting at point pi; call with lock held,
+ * which is dropped while the span is inflated */
+static int qgz_get_span(qd_gz *gz, uint32_t pi)
+{
+	uint64_t end=(pi+1<gz->npts) ? gz->pts[pi+1].out : gz->usize;
+	uint32_t len=end-gz->pts[pi].out;
+	uint32_t olen;
+	uint8_t *buf;
+	int i,v,r;
+
+	for(;;)
+	{
+		for(i=0,v=-1;i<QGZ_NCACHE;i++)
+		{
+			if(gz->span[i].pt==pi)
+				break;
+			if(!gz->span[i].busy && (v<0 || gz->span[i].age<gz->span[v].age))
+				v=i;
+		}
+		if(i<QGZ_NCACHE && !gz->span[i].busy)
+		{
+			gz->span[i].age=++gz->clock;
+			return i;
+		}
+		if(i==QGZ_NCACHE && v>=0)
+			break;
+		/* being inflated by another thread, or every slot is */
+		pthread_cond_wait(&gz->done,&gz->lock);
+	}
+
+	/* least recently used slot; its buffer is reused */
+	buf=gz->span[v].buf;
+	olen=gz->span[v].len;
+	gz->span[v].buf=NULL;
+	gz->span[v].len=0;
+	gz->span[v].pt=pi;
+	gz->span[v].busy=1;
+	pthread_mutex_unlock(&gz->lock);
+
+	if(buf==NULL || olen<len)
+	{
+		free(buf);
+		if((buf=malloc(len ? len : 1))==NULL)
+			func_abort("alloc error!");
+	}
+	r=qgz_inflate_span(gz,pi,buf,len);
+
+	pthread_mutex_lock(&gz->lock);
+	gz->span[v].busy=0;
+	gz->span[v].buf=buf;
+	if(r)
+		gz->span[v].pt=QC_EMPTY;
+	else
+		gz->span[v].len=len;
+	gz->span[v].age=++gz->clock;
+	pthread_cond_broadcast(&gz->done);
+	return r ? -1 : v;
+}
+
+int qgz_read(qd_gz *gz, void *buf, uint64_t off, uint32_t count)
+{
+	uint8_t *dbuf=(uint8_t *)buf;
+	uint32_t lo,hi,mid;
+	uint64_t so;
+	uint32_t l;
+	int i;
+
+	if(off+count > gz->usize)
+		func_abort("Trying to read beyond end of image (offset %" PRIu64 ")",off);
+
+	/* spans are shared by all threads; only cache lookups and the copy
+	 * out are done with the lock held, not inflate */
+	pthread_mutex_lock(&gz->lock);
+	while(count)
+	{
+		/* last point at or before off */
+		lo=0;
+		hi=gz->npts;
+		while(hi-lo>1)
+		{
+			mid=(lo+hi)/2;
+			if(gz->pts[mid].out<=off)
+				lo=mid;
+			else
+				hi=mid;
+		}
+		if((i=qgz_get_span(gz,lo))<0)
+		{
+			pthread_mutex_unlock(&gz->lock);
+			return -1;
+		}
+		so=off-gz->pts[lo].out;
+		l=MIN(gz->span[i].len-so,count);
+		if(!l)	/* first point is past 0 (headers only before it) */
+			break;
+		memcpy(dbuf,gz->span[i].buf+so,l);
+		dbuf+=l;
+		off+=l;
+		count-=l;
+	}
+	pthread_mutex_unlock(&gz->lock);
+	return count ? -1 : 0;
+}
+
+/* qd_backend glue; with QDO_GZIDX the access points are kept in <path>.gzi */
+static int qgz_be_open(qd_image *img, const char *path, int oflags)
+{
+	char *ipath=NULL;
+	qd_gz *gz;
+
+	if((oflags & QDO_GZIDX) && (ipath=malloc(strlen(path)+5))!=NULL)
+		sprintf(ipath,"%s.gzi",path);
+	gz=qgz_open(img->fd,ipath);
+	free(ipath);
+	if(gz==NULL)
+		return -1;
+	img->priv=gz;
+	img->isize=gz->usize;
+	return 0;
+}
+
+static int qgz_be_read(qd_image *img, void *buf, uint64_t off, uint32_t count)
+{
+	return qgz_read((qd_gz *)img->priv,buf,off,count);
+}
+
+static void qgz_be_close(qd_image *img)
+{
+	qgz_close((qd_gz *)img->priv);
+}
+
+const qd_backend qgz_backend={"gzip",qgz_probe,qgz_be_open,qgz_be_read,qgz_be_close,NULL};
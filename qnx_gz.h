@@ -0,0 +1,93 @@
+/* qnx_gz.h - random access to gzip/zlib compressed disk images
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* The compressed stream is decompressed once to build a list of access
+ * points (about every QGZ_SPAN bytes of output, at deflate block boundaries)
+ * holding the 32K of history needed to restart inflate there. A read then
+ * decompresses only the span(s) it needs; recently used spans are kept.
+ * Spans are inflated outside the cache lock, so threads reading different
+ * spans decompress in parallel; a thread needing a span that is being
+ * inflated waits for it instead of inflating it again.
+ * The access points can be saved to (and loaded from) a sidecar file, which
+ * is stale if the compressed file size or mtime changed. */
+
+#define QGZ_MAGIC "QNXGZI1"
+#define QGZ_VERSION 1
+#define QGZ_SPAN	(1<<20)	/* min. distance between access points (output bytes) */
+#define QGZ_WINSIZE	32768	/* inflate history */
+#define QGZ_NCACHE	8		/* decompressed spans kept */
+
+#pragma pack(1)
+struct qgz_header	/* sidecar file header, followed by npts qgz_point */
+{
+	char magic[8];
+	uint32_t version;
+	uint64_t csize;		/* compressed file size */
+	int64_t mtime;		/* compressed file mtime */
+	uint64_t usize;		/* uncompressed size */
+	uint32_t npts;
+};
+#pragma pack()
+
+typedef struct qgz_point
+{
+	uint64_t out;		/* uncompressed offset */
+	uint64_t in;		/* compressed offset of first full byte */
+	int32_t bits;		/* bits of byte at in-1 still to use (0-7) */
+	uint8_t window[QGZ_WINSIZE];	/* history, oldest byte first */
+} qgz_point;
+
+typedef struct qd_gz
+{
+	int fd;				/* compressed file (not owned) */
+	uint64_t csize;
+	uint64_t usize;
+	uint32_t npts;
+	qgz_point *pts;
+	pthread_mutex_t lock;	/* protects the span cache */
+	pthread_cond_t done;	/* a span finished inflating */
+	struct
+	{
+		uint32_t pt;		/* span starts at this point (QC_EMPTY = unused) */
+		uint32_t len;
+		uint32_t age;
+		int busy;			/* being inflated, buf not valid yet */
+		uint8_t *buf;
+	} span[QGZ_NCACHE];
+	uint32_t clock;
+} qd_gz;
+
+/* qnx_disk backend (qd_open picks it for gzip/zlib files) */
+extern const qd_backend qgz_backend;
+
+/* 1 if the file at fd starts with a gzip or zlib header */
+int qgz_probe(int fd);
+
+/* build (or load from sidecar ipath, if not NULL and up to date) the access
+ * points of the compressed file fd; a built index is saved to ipath.
+ * returns NULL on error */
+qd_gz *qgz_open(int fd, const char *ipath);
+void qgz_close(qd_gz *gz);
+
+/* read count uncompressed bytes at offset off */
+int qgz_read(qd_gz *gz, void *buf, uint64_t off, uint32_t count);
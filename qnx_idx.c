@@ -0,0 +1,412 @@
+/* qnx_idx.c - QNX (1.2) filesystem index (sidecar file) functions
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "qnx_acc.h"
+#include "qnx_idx.h"
+
+/* index being built */
+typedef struct qi_bld
+{
+	struct qi_entry *ent;
+	uint32_t nent,cent;
+	qnx_xmap *xm;
+	uint32_t nxm,cxm;
+	char *str;
+	uint32_t strsz,cstr;
+} qi_bld;
+
+/* FNV-1a */
+static uint32_t qi_hash(const void *p, size_t l)
+{
+	const uint8_t *b=(const uint8_t *)p;
+	uint32_t h=2166136261u;
+	while(l--)
+		h=(h^*b++)*16777619u;
+	return h;
+}
+
+/* grow array *p (element size es) so that it holds at least n elements */
+static int qi_grow(void **p, uint32_t *cap, uint32_t n, size_t es)
+{
+	void *np;
+	uint32_t nc=*cap ? *cap : 64;
+	if(n<=*cap)
+		return 0;
+	while(nc<n) nc*=2;
+	if((np=realloc(*p,(size_t)nc*es))==NULL)
+		func_abort("alloc error!");
+	*p=np;
+	*cap=nc;
+	return 0;
+}
+
+/* key of the image, as stored in qi_header */
+static int qi_key(qnx_disk *qd, struct qi_header *h)
+{
+	struct stat s;
+	uint8_t sb[Q_BLOCKSIZE];
+
+	if(fstat(qd->fd,&s))
+		func_abort("fstat error");
+	if(qd_read(qd,sb,0,Q_BLOCKSIZE))
+		func_abort("can't read superblock");
+	h->isize=s.st_size;
+	h->mtime=s.st_mtime;
+	h->ioff=qd->ioff;
+	h->sbsum=qi_hash(sb,Q_BLOCKSIZE);
+	return 0;
+}
+
+/* add entry for de (child of parent); returns its index or QI_NONE */
+static uint32_t qi_add(qnx_disk *qd, qi_bld *b, struct q_dir_entry *de, uint32_t parent)
+{
+	struct qi_entry *e;
+	qnx_file fd;
+	const char *pp;
+	char name[QNX_MAXFNLEN+2];
+	size_t pl,nl;
+	int32_t fsize;
+
+	name[QNX_MAXFNLEN+1]=0;
+	memcpy(name,de->fname,QNX_MAXFNLEN+1);
+	nl=strlen(name);
+	pl=(parent==QI_NONE) ? 0 : strlen(b->str+b->ent[parent].path);
+	if(pl==1)	/* root is "/", don't double the separator */
+		pl=0;
+
+	if(qi_grow((void **)&b->ent,&b->cent,b->nent+1,sizeof(struct qi_entry)) ||
+		qi_grow((void **)&b->str,&b->cstr,b->strsz+pl+nl+2,1))
+		return QI_NONE;
+	pp=(parent==QI_NONE) ? "" : b->str+b->ent[parent].path;	/* after realloc */
+
+	if(qnx_de2fd(qd,de,&fd))
+		return QI_NONE;
+	if(qnx_build_xmap(&fd) ||
+		qi_grow((void **)&b->xm,&b->cxm,b->nxm+fd.nxmap,sizeof(qnx_xmap)))
+	{
+		qnx_close(&fd);
+		return QI_NONE;
+	}
+	fsize=fd.fsize;
+	memcpy(b->xm+b->nxm,fd.xmap,fd.nxmap*sizeof(qnx_xmap));
+
+	e=&b->ent[b->nent];
+	memset(e,0,sizeof(struct qi_entry));
+	memcpy(&e->de,de,sizeof(struct q_dir_entry));
+	e->fsize=fsize;
+	e->parent=parent;
+	e->xfirst=b->nxm;
+	e->nx=fd.nxmap;
+	e->path=b->strsz;
+	memcpy(b->str+b->strsz,pp,pl);
+	b->str[b->strsz+pl]='/';
+	memcpy(b->str+b->strsz+pl+1,name,nl+1);
+	if(parent==QI_NONE)	/* root itself */
+		b->str[b->strsz+1]=0;
+	e->phash=qi_hash(b->str+e->path,strlen(b->str+e->path));
+	b->strsz+=strlen(b->str+e->path)+1;
+	b->nxm+=fd.nxmap;
+	qnx_close(&fd);
+	return b->nent++;
+}
+
+/* add all children of directory entry i (contiguous) */
+static int qi_add_dir(qnx_disk *qd, qi_bld *b, uint32_t i)
+{
+	qnx_file fd;
+	struct q_dir_entry *de;
+	qnx_diter it;
+	uint32_t a,ci;
+	uint32_t maxent=MIN(qd->isize/sizeof(struct q_dir_entry),UINT32_MAX);
+
+	/* don't follow a directory that is its own ancestor (corrupted image) */
+	for(a=b->ent[i].parent;a!=QI_NONE;a=b->ent[a].parent)
+		if(b->ent[a].de.ffirst_xtnt==b->ent[i].de.ffirst_xtnt)
+			func_abort("directory loop at %s",b->str+b->ent[i].path);
+
+	if(qnx_de2fd(qd,&b->ent[i].de,&fd))
+		return -1;
+	if(qnx_diter_init(&it,&fd))
+	{
+		qnx_close(&fd);
+		return -1;
+	}
+	it.pfent=1;	/* every entry is opened (size, subdirectories) */
+	b->ent[i].child=b->nent;
+	while((de=qnx_diter_next(&it))!=NULL)
+	{
+		if(b->nent>=maxent)
+		{
+			qnx_diter_close(&it);
+			qnx_close(&fd);
+			func_abort("too many directory entries");
+		}
+		if((ci=qi_add(qd,b,de,i))==QI_NONE)
+		{
+			func_msg("skipping %.*s",QNX_MAXFNLEN,de->fname);
+			continue;
+		}
+		b->ent[i].nchild++;
+	}
+	qnx_diter_close(&it);
+	qnx_close(&fd);
+	return 0;
+}
+
+int qi_build(qnx_disk *qd, const char *ipath)
+{
+	struct q_block1 sb;
+	struct qi_header h;
+	qi_bld b;
+	uint32_t *hash=NULL;
+	uint32_t i,j;
+	char *tpath=NULL;
+	FILE *f=NULL;
+	int r=-1;
+
+	memset(&b,0,sizeof(b));
+	memset(&h,0,sizeof(h));
+	if(qi_key(qd,&h))
+		return -1;
+	if(qd_read(qd,&sb,0,sizeof(struct q_block1)))
+		func_abort("can't read superblock");
+	if(qi_add(qd,&b,&sb.root_dir,QI_NONE)==QI_NONE)
+	{
+		func_msg("can't open root directory");
+		goto eofunc;
+	}
+
+	/* breadth first, so that children of a directory are contiguous */
+	for(i=0;i<b.nent;i++)
+		if((b.ent[i].de.fattr & QFA_DIRECTORY) && qi_add_dir(qd,&b,i))
+			func_msg("can't read directory %s",b.str+b.ent[i].path);
+
+	memcpy(h.magic,QI_MAGIC,sizeof(h.magic));
+	h.version=QI_VERSION;
+	h.nent=b.nent;
+	for(h.nhash=16;h.nhash<2*b.nent;h.nhash<<=1);
+	h.nxmap=b.nxm;
+	h.strsz=b.strsz;
+
+	if((hash=calloc(h.nhash,sizeof(uint32_t)))==NULL)
+	{
+		func_msg("alloc error!");
+		goto eofunc;
+	}
+	for(i=0;i<b.nent;i++)
+	{
+		for(j=b.ent[i].phash&(h.nhash-1);hash[j];j=(j+1)&(h.nhash-1));
+		hash[j]=i+1;
+	}
+
+	/* write to temporary file, then rename - readers never see half an index */
+	if((tpath=malloc(strlen(ipath)+5))==NULL)
+		goto eofunc;
+	sprintf(tpath,"%s.tmp",ipath);
+	if((f=fopen(tpath,"wb"))==NULL)
+	{
+		func_msg("can't create %s",tpath);
+		goto eofunc;
+	}
+	if(fwrite(&h,sizeof(h),1,f)!=1 ||
+		fwrite(b.ent,sizeof(struct qi_entry),b.nent,f)!=b.nent ||
+		fwrite(hash,sizeof(uint32_t),h.nhash,f)!=h.nhash ||
+		fwrite(b.xm,sizeof(qnx_xmap),b.nxm,f)!=b.nxm ||
+		fwrite(b.str,1,b.strsz,f)!=b.strsz)
+	{
+		func_msg("write error on %s",tpath);
+		goto eofunc;
+	}
+	if(fclose(f))
+	{
+		f=NULL;
+		func_msg("write error on %s",tpath);
+		goto eofunc;
+	}
+	f=NULL;
+	if(rename(tpath,ipath))
+	{
+		func_msg("can't rename %s to %s",tpath,ipath);
+		goto eofunc;
+	}
+	r=0;
+
+eofunc:
+	if(f!=NULL)
+		fclose(f);
+	if(r && tpath!=NULL)
+		unlink(tpath);
+	free(tpath);
+	free(hash);
+	free(b.ent);
+	free(b.xm);
+	free(b.str);
+	return r;
+}
+
+void qi_close(qnx_index *qi)
+{
+	if(qi->map!=NULL)
+		munmap(qi->map,qi->msize);
+	memset(qi,0,sizeof(qnx_index));
+}
+
+int qi_open(qnx_disk *qd, qnx_index *qi, const char *ipath)
+{
+	struct qi_header k;
+	const struct qi_header *h;
+	struct stat s;
+	size_t esz;
+	uint32_t i;
+	int fd;
+	void *m;
+
+	memset(qi,0,sizeof(qnx_index));
+	if((fd=open(ipath,O_RDONLY))<0)
+		return 1;
+	if(fstat(fd,&s) || s.st_size<(off_t)sizeof(struct qi_header))
+	{
+		close(fd);
+		return 1;
+	}
+	m=mmap(NULL,s.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(m==MAP_FAILED)
+		func_abort("can't map %s",ipath);
+	qi->map=m;
+	qi->msize=s.st_size;
+	h=qi->h=m;
+
+	memset(&k,0,sizeof(k));
+	if(qi_key(qd,&k) || memcmp(h->magic,QI_MAGIC,sizeof(h->magic)) || h->version!=QI_VERSION ||
+		h->isize!=k.isize || h->mtime!=k.mtime || h->ioff!=k.ioff || h->sbsum!=k.sbsum)
+	{
+		qi_close(qi);
+		return 1;
+	}
+
+	/* structural checks, so lookups can trust the tables */
+	esz=sizeof(struct qi_header)+(size_t)h->nent*sizeof(struct qi_entry)+(size_t)h->nhash*sizeof(uint32_t)
+		+(size_t)h->nxmap*sizeof(qnx_xmap)+h->strsz;
+	if(esz!=qi->msize || !h->nent || !h->nhash || (h->nhash & (h->nhash-1)) || !h->strsz)
+		goto badidx;
+	qi->ent=(const struct qi_entry *)(qi->map+sizeof(struct qi_header));
+	qi->hash=(const uint32_t *)(qi->ent+h->nent);
+	qi->xmap=(const qnx_xmap *)(qi->hash+h->nhash);
+	qi->str=(const char *)(qi->xmap+h->nxmap);
+	if(qi->str[h->strsz-1])
+		goto badidx;
+	for(i=0;i<h->nent;i++)
+		if(qi->ent[i].path>=h->strsz || qi->ent[i].xfirst+(uint64_t)qi->ent[i].nx>h->nxmap ||
+			qi->ent[i].child+(uint64_t)qi->ent[i].nchild>h->nent)
+			goto badidx;
+	for(i=0;i<h->nhash;i++)
+		if(qi->hash[i]>h->nent)
+			goto badidx;
+	return 0;
+
+badidx:
+	func_msg("%s is corrupted",ipath);
+	qi_close(qi);
+	return 1;
+}
+
+int qi_open_build(qnx_disk *qd, qnx_index *qi, const char *ipath)
+{
+	int r=qi_open(qd,qi,ipath);
+	if(r!=1)
+		return r;
+	if(qi_build(qd,ipath))
+		return -1;
+	return qi_open(qd,qi,ipath) ? -1 : 0;
+}
+
+uint32_t qi_lookup(qnx_index *qi, const char *path)
+{
+	char *np;
+	size_t l=0,cl;
+	uint32_t i,e;
+	const char *p=path;
+
+	if((np=malloc(strlen(path)+2))==NULL)
+		return QI_NONE;
+	/* normalize to "/a/b" ("/" for root) */
+	while(*p)
+	{
+		while(*p=='/') p++;
+		if(!*p) break;
+		cl=strcspn(p,"/");
+		np[l++]='/';
+		memcpy(np+l,p,cl);
+		l+=cl;
+		p+=cl;
+	}
+	if(!l)
+		np[l++]='/';
+	np[l]=0;
+
+	e=QI_NONE;
+	for(i=qi_hash(np,l)&(qi->h->nhash-1);qi->hash[i];i=(i+1)&(qi->h->nhash-1))
+		if(strcmp(qi->str+qi->ent[qi->hash[i]-1].path,np)==0)
+		{
+			e=qi->hash[i]-1;
+			break;
+		}
+	free(np);
+	return e;
+}
+
+int qi_open_file(qnx_index *qi, qnx_disk *qd, uint32_t ei, qnx_file *fd)
+{
+	const struct qi_entry *e;
+
+	if(ei>=qi->h->nent)
+		func_abort("bad index entry %u",ei);
+	e=&qi->ent[ei];
+	if(!e->nx)	/* nothing to preload */
+		return qnx_de2fd(qd,(struct q_dir_entry *)&e->de,fd);
+
+	memset(fd,0,sizeof(qnx_file));
+	fd->qd=qd;
+	fd->attrs=e->de.fattr;
+	fd->firstx=e->de.ffirst_xtnt;
+	fd->fsize=e->fsize;
+	if((fd->xmap=malloc(e->nx*sizeof(qnx_xmap)))==NULL)
+		func_abort("alloc error!");
+	memcpy(fd->xmap,qi->xmap+e->xfirst,e->nx*sizeof(qnx_xmap));
+	fd->nxmap=e->nx;
+	if(qnx_seek(fd,0)<0)	/* sets current extent from xmap, no disk access */
+	{
+		qnx_close(fd);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+/* qnx_idx.h - persistent (sidecar file) index of a QNX (1.2) filesystem
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+/* The index is built by walking the whole filesystem once. It holds every
+ * directory entry (children of a directory are contiguous), its size and
+ * extent map, plus a hash table of full paths. It is mapped read-only and
+ * used as is, so the file layout is the in-memory layout (little endian). */
+
+#define QI_MAGIC "QNXIDX1"
+#define QI_VERSION 2
+#define QI_NONE 0xffffffff
+
+#pragma pack(1)
+struct qi_header
+{
+	char magic[8];
+	uint32_t version;
+	/* key - index is stale if any of these differ */
+	uint64_t isize;		/* image file size */
+	int64_t mtime;		/* image file mtime */
+	uint64_t ioff;		/* partition offset */
+	uint32_t sbsum;		/* checksum of superblock sector */
+	/* contents */
+	uint32_t nent;		/* entries (0 is root directory) */
+	uint32_t nhash;		/* hash slots (power of 2) */
+	uint32_t nxmap;		/* extent map entries */
+	uint32_t strsz;		/* string table size */
+	/* tables follow in this order: entries, hash, extents, strings */
+};
+
+struct qi_entry
+{
+	struct q_dir_entry de;
+	uint32_t fsize;
+	uint32_t parent;	/* parent entry (QI_NONE for root) */
+	uint32_t child;		/* first child entry (directories) */
+	uint32_t nchild;
+	uint32_t xfirst;	/* first extent map entry */
+	uint32_t nx;		/* number of extents */
+	uint32_t path;		/* full path, offset into string table */
+	uint32_t phash;		/* hash of full path */
+};
+#pragma pack()
+
+typedef struct qnx_index
+{
+	uint8_t *map;
+	size_t msize;
+	const struct qi_header *h;
+	const struct qi_entry *ent;
+	const uint32_t *hash;	/* entry index + 1, 0 = empty slot */
+	const qnx_xmap *xmap;
+	const char *str;
+} qnx_index;
+
+/* walk filesystem on qd and write index to ipath */
+int qi_build(qnx_disk *qd, const char *ipath);
+
+/* map index at ipath. returns 0 if ok, 1 if missing or stale (doesn't match
+ * image opened as qd), -1 on errors */
+int qi_open(qnx_disk *qd, qnx_index *qi, const char *ipath);
+
+/* qi_open, (re)building the index first if it is missing or stale */
+int qi_open_build(qnx_disk *qd, qnx_index *qi, const char *ipath);
+
+void qi_close(qnx_index *qi);
+
+/* entry index for path (any number of '/' between components)
+ * returns QI_NONE if not found */
+uint32_t qi_lookup(qnx_index *qi, const char *path);
+
+/* open entry ei as fd; size and extent map come from the index */
+int qi_open_file(qnx_index *qi, qnx_disk *qd, uint32_t ei, qnx_file *fd);
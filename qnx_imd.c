@@ -0,0 +1,277 @@
+/* qnx_imd.c - ImageDisk (IMD) floppy image access
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "qnx_acc.h"
+#include "qnx_imd.h"
+
+int qimd_probe(int fd)
+{
+	char h[4];
+
+	return pread(fd,h,4,0)==4 && !memcmp(h,"IMD ",4);
+}
+
+/* flat image order */
+static int qimd_key(const qimd_sec *x, const qimd_sec *y)
+{
+	if(x->cyl!=y->cyl)
+		return x->cyl-y->cyl;
+	if(x->head!=y->head)
+		return x->head-y->head;
+	return x->id-y->id;
+}
+
+static int qimd_cmp(const void *a, const void *b)
+{
+	const qimd_sec *x=(const qimd_sec *)a,*y=(const qimd_sec *)b;
+	int r=qimd_key(x,y);
+
+	if(r)
+		return r;
+	return (x->pos>y->pos)-(x->pos<y->pos);	/* keep file order for duplicates */
+}
+
+/* walk all tracks, adding one entry per sector record */
+static int qimd_parse(qd_imd *imd)
+{
+	const uint8_t *f=imd->fbuf;
+	const uint8_t *smap,*stab;
+	const uint8_t *cp;
+	size_t pos,fsz=imd->fsize;
+	uint32_t cap=0,ns,size,j;
+	uint8_t cyl,head,scode,type;
+	qimd_sec *e;
+
+	if((cp=memchr(f,0x1a,fsz))==NULL)
+		func_abort("no end of comment");
+	pos=cp-f+1;
+	while(pos<fsz)
+	{
+		/* track header */
+		if(pos+5>fsz)
+			func_abort("truncated track header at %zu",pos);
+		if(f[pos]>5)
+			func_abort("bad track mode %u at %zu",f[pos],pos);
+		cyl=f[pos+1];
+		head=f[pos+2];
+		ns=f[pos+3];
+		scode=f[pos+4];
+		if(scode>6 && scode!=0xff)
+			func_abort("bad sector size code %u at %zu",scode,pos);
+		smap=f+pos+5;
+		pos+=5+ns;
+		if(head & 0x80)	/* cylinder map */
+			pos+=ns;
+		if(head & 0x40)	/* head map */
+			pos+=ns;
+		stab=f+pos;
+		if(scode==0xff)	/* sector size table */
+			pos+=2*ns;
+		if(pos>fsz)
+			func_abort("truncated track maps");
+
+		if(imd->nsec+ns>cap)
+		{
+			cap=(imd->nsec+ns)*2;
+			if((e=realloc(imd->sec,cap*sizeof(qimd_sec)))==NULL)
+				func_abort("alloc error!");
+			imd->sec=e;
+		}
+		for(j=0;j<ns;j++)
+		{
+			size=(scode==0xff) ? stab[2*j] | stab[2*j+1]<<8 : 128u<<scode;
+			if(!size || size>QIMD_MAXSECSZ || pos>=fsz)
+				func_abort("bad sector record at %zu",pos);
+			type=f[pos++];
+			e=imd->sec+imd->nsec++;
+			e->pos=pos-1;
+			e->cyl=cyl;
+			e->head=head & 0x3f;
+			e->id=smap[j];
+			e->size=size;
+			e->foff=0;
+			if(type>8)
+				func_abort("bad sector type %u at %zu",type,pos-1);
+			if(!type)				/* unavailable - read as zeros */
+				e->fill=0;
+			else if(type & 1)		/* data */
+			{
+				if(pos+size>fsz)
+					func_abort("truncated sector at %zu",pos);
+				e->fill=-1;
+				e->foff=pos;
+				pos+=size;
+			}
+			else					/* compressed */
+			{
+				if(pos>=fsz)
+					func_abort("truncated sector at %zu",pos);
+				e->fill=f[pos++];
+			}
+		}
+	}
+	return 0;
+}
+
+qd_imd *qimd_open(int fd)
+{
+	struct stat s;
+	qd_imd *imd;
+	void *m;
+	uint8_t *b;
+	uint32_t i,n;
+	uint64_t off;
+
+	if(fstat(fd,&s) || (imd=calloc(1,sizeof(qd_imd)))==NULL)
+	{
+		func_msg("can't open IMD file");
+		return NULL;
+	}
+	imd->fsize=s.st_size;
+
+	/* whole file in memory (IMD files are floppy sized) */
+	if((m=mmap(NULL,imd->fsize,PROT_READ,MAP_PRIVATE,fd,0))!=MAP_FAILED)
+	{
+		imd->fbuf=m;
+		imd->mapped=1;
+	}
+	else if((b=malloc(imd->fsize))==NULL || pread(fd,b,imd->fsize,0)!=(ssize_t)imd->fsize)
+	{
+		free(b);
+		free(imd);
+		func_msg("can't read IMD file");
+		return NULL;
+	}
+	else
+		imd->fbuf=b;
+
+	if(qimd_parse(imd) || !imd->nsec)
+	{
+		qimd_close(imd);
+		return NULL;
+	}
+
+	/* flat image order; a sector recorded more than once is used once */
+	qsort(imd->sec,imd->nsec,sizeof(qimd_sec),qimd_cmp);
+	for(i=n=0;i<imd->nsec;i++)
+		if(!n || qimd_key(imd->sec+i,imd->sec+n-1))
+			imd->sec[n++]=imd->sec[i];
+	imd->nsec=n;
+	imd->ssize=imd->sec[0].size;
+	for(i=0,off=0;i<imd->nsec;i++)
+	{
+		imd->sec[i].loff=off;
+		off+=imd->sec[i].size;
+		if(imd->sec[i].size!=imd->ssize)
+			imd->ssize=0;
+	}
+	imd->isize=off;
+	return imd;
+}
+
+void qimd_close(qd_imd *imd)
+{
+	if(imd==NULL)
+		return;
+	if(imd->mapped)
+		munmap((void *)imd->fbuf,imd->fsize);
+	else
+		free((void *)imd->fbuf);
+	free(imd->sec);
+	free(imd);
+}
+
+int qimd_read(qd_imd *imd, void *buf, uint64_t off, uint32_t count)
+{
+	uint8_t *dbuf=(uint8_t *)buf;
+	const qimd_sec *e;
+	uint32_t lo,hi,mid;
+	uint32_t so,l;
+
+	if(off+count > imd->isize)
+		func_abort("Trying to read beyond end of image (offset %" PRIu64 ")",off);
+
+	/* first sector: direct for uniform sector sizes (the usual case) */
+	if(imd->ssize)
+		lo=off/imd->ssize;
+	else
+	{
+		lo=0;
+		hi=imd->nsec;
+		while(hi-lo>1)
+		{
+			mid=(lo+hi)/2;
+			if(imd->sec[mid].loff<=off)
+				lo=mid;
+			else
+				hi=mid;
+		}
+	}
+
+	for(e=imd->sec+lo;count;e++)
+	{
+		so=off-e->loff;
+		l=MIN(e->size-so,count);
+		if(e->fill<0)
+			memcpy(dbuf,imd->fbuf+e->foff+so,l);
+		else
+			memset(dbuf,e->fill,l);
+		dbuf+=l;
+		off+=l;
+		count-=l;
+	}
+	return 0;
+}
+
+/* qd_backend glue */
+static int qimd_be_open(qd_image *img, const char *path, int oflags)
+{
+	qd_imd *imd;
+
+	if((imd=qimd_open(img->fd))==NULL)
+		return -1;
+	img->priv=imd;
+	img->isize=imd->isize;
+	return 0;
+}
+
+static int qimd_be_read(qd_image *img, void *buf, uint64_t off, uint32_t count)
+{
+	return qimd_read((qd_imd *)img->priv,buf,off,count);
+}
+
+static void qimd_be_close(qd_image *img)
+{
+	qimd_close((qd_imd *)img->priv);
+}
+
+const qd_backend qimd_backend={"IMD",qimd_probe,qimd_be_open,qimd_be_read,qimd_be_close,NULL};
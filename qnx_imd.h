@@ -0,0 +1,65 @@
+/* qnx_imd.h - ImageDisk (IMD) floppy image access
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* An IMD file is a comment (ending with 0x1a) followed by tracks: a header
+ * (mode, cylinder, head, sector count, size code), the sector numbering map,
+ * optional cylinder/head maps and size table, then one record per sector:
+ * type byte plus data, a single fill byte for sectors with all bytes equal
+ * ("compressed") or nothing for unavailable ones. It is parsed once into a
+ * table of sectors in (cylinder, head, sector number) order, the flat image
+ * seen by qnx_disk; the file itself is kept in memory (mapped if possible). */
+
+#define QIMD_MAXSECSZ	8192	/* size code 6 */
+
+typedef struct qimd_sec
+{
+	uint64_t loff;		/* offset in the flat image */
+	uint64_t foff;		/* data offset in IMD file (fill < 0) */
+	uint32_t size;
+	uint64_t pos;		/* sector record offset in IMD file */
+	int16_t fill;		/* fill byte (compressed/unavailable sectors) or -1 */
+	uint8_t cyl;
+	uint8_t head;
+	uint8_t id;			/* sector number, as in the numbering map */
+} qimd_sec;
+
+typedef struct qd_imd
+{
+	const uint8_t *fbuf;	/* whole IMD file */
+	size_t fsize;
+	int mapped;				/* fbuf is a mapping (else malloc'ed) */
+	qimd_sec *sec;
+	uint32_t nsec;
+	uint32_t ssize;			/* sector size if all are the same, else 0 */
+	uint64_t isize;			/* flat image size */
+} qd_imd;
+
+/* qnx_disk backend (qd_open picks it for files starting with "IMD ") */
+extern const qd_backend qimd_backend;
+
+int qimd_probe(int fd);
+/* parse IMD file fd; returns NULL on error */
+qd_imd *qimd_open(int fd);
+void qimd_close(qd_imd *imd);
+/* read count bytes at offset off of the flat image */
+int qimd_read(qd_imd *imd, void *buf, uint64_t off, uint32_t count);
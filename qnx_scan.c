@@ -0,0 +1,303 @@
+/* qnx_scan.c - whole image scan for extent headers (orphaned/deleted files)
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qnx_acc.h"
+#include "qnx_scan.h"
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+/* blocks taken by an extent with size data bytes */
+#define QS_NEED(size)	(((uint64_t)(size)+sizeof(struct q_xtnt_header)+Q_BLOCKSIZE-1)/Q_BLOCKSIZE)
+
+static void qs_mark(qnx_scan *s, uint32_t bn, uint64_t n)
+{
+	for(;n && bn<=s->nblocks;n--,bn++)
+		s->reach[bn>>3] |= 1<<(bn&7);
+}
+
+/* mark blocks of all extents of dir (and everything below it) as reachable;
+ * rs marks reachable extent starts */
+static void qs_walk(qnx_scan *s, qnx_file *dfd, uint8_t *rs, int depth)
+{
+	qnx_file fd;
+	qnx_diter it;
+	struct q_dir_entry *de;
+	uint32_t i;
+
+	if(dfd->xmap==NULL && qnx_build_xmap(dfd))
+		return;
+	for(i=0;i<dfd->nxmap;i++)
+	{
+		rs[dfd->xmap[i].bn>>3] |= 1<<(dfd->xmap[i].bn&7);
+		qs_mark(s,dfd->xmap[i].bn,QS_NEED(dfd->xmap[i].size));
+	}
+	if(!(dfd->attrs & QFA_DIRECTORY) || depth>64 || qnx_diter_init(&it,dfd))
+		return;
+	while((de=qnx_diter_next(&it))!=NULL)
+	{
+		/* already seen (cross-linked or looping directory) */
+		if(de->ffirst_xtnt<=0 || (uint32_t)de->ffirst_xtnt>s->nblocks ||
+			(rs[de->ffirst_xtnt>>3] & (1<<(de->ffirst_xtnt&7))))
+			continue;
+		if(qnx_de2fd(s->qd,de,&fd))
+			continue;
+		qs_walk(s,&fd,rs,depth+1);
+		qnx_close(&fd);
+	}
+	qnx_diter_close(&it);
+}
+
+/* range check of the headers of n blocks in buf: sets ok[i] for blocks
+ * with prev/next/bound in 1..maxbn (bound) or 0..maxbn and size <= maxsz */
+static void qs_precheck(const uint8_t *buf, uint32_t n, uint32_t maxbn, uint32_t maxsz, uint8_t *ok)
+{
+	uint32_t i;
+#ifdef __SSE2__
+	/* unsigned compare via signed one, bound-1 so that 0 wraps around */
+	const __m128i sgn=_mm_set1_epi32(0x80000000);
+	const __m128i one=_mm_set_epi32(1,0,0,0);
+	const __m128i lim=_mm_xor_si128(_mm_set_epi32(maxbn,maxsz+1,maxbn+1,maxbn+1),sgn);
+	__m128i h;
+
+	for(i=0;i<n;i++)
+	{
+		h=_mm_loadu_si128((const __m128i *)(buf+(size_t)i*Q_BLOCKSIZE));
+		h=_mm_xor_si128(_mm_sub_epi32(h,one),sgn);
+		ok[i]=_mm_movemask_epi8(_mm_cmplt_epi32(h,lim))==0xffff;
+	}
+#else
+	const struct q_xtnt_header *h;
+
+	for(i=0;i<n;i++)
+	{
+		h=(const struct q_xtnt_header *)(buf+(size_t)i*Q_BLOCKSIZE);
+		ok[i]=h->prev_xtnt<=maxbn && h->next_xtnt<=maxbn && h->size_xtnt<=maxsz &&
+			h->bound_xtnt-1<maxbn;
+	}
+#endif
+}
+
+static int qs_add(qnx_scan *s, uint32_t *cap, uint32_t bn, const struct q_xtnt_header *h, uint32_t flags)
+{
+	qs_xtnt *nx;
+
+	if(s->nx==*cap)
+	{
+		*cap=*cap ? *cap*2 : 1024;
+		if((nx=realloc(s->x,*cap*sizeof(qs_xtnt)))==NULL)
+			func_abort("alloc error!");
+		s->x=nx;
+	}
+	nx=s->x+s->nx++;
+	nx->bn=bn;
+	memcpy(&nx->h,h,sizeof(struct q_xtnt_header));
+	nx->prev=nx->next=nx->chain=QS_NONE;
+	nx->flags=flags;
+	return 0;
+}
+
+/* one sequential pass over all blocks; rs NULL - keep all valid headers */
+static int qs_pass(qnx_scan *s, const uint8_t *rs)
+{
+	uint8_t *buf,ok[QS_CHUNK];
+	const uint8_t *p;
+	struct q_xtnt_header h;
+	uint32_t maxbn=s->nblocks;
+	uint32_t maxsz=(uint64_t)maxbn*Q_BLOCKSIZE>UINT32_MAX-1 ? UINT32_MAX-1 : maxbn*Q_BLOCKSIZE;
+	uint32_t bn,n,i,cap=0;
+	uint64_t need,cover=0;	/* last block covered by an accepted orphan extent */
+	int r;
+
+	if((buf=malloc((size_t)QS_CHUNK*Q_BLOCKSIZE))==NULL)
+		func_abort("alloc error!");
+	for(bn=1;bn<=maxbn;bn+=n)
+	{
+		n=MIN(QS_CHUNK,maxbn-bn+1);
+		if((p=qd_map(s->qd,QBN2OFF(bn),n*Q_BLOCKSIZE))==NULL)
+		{
+			if(qd_read(s->qd,buf,QBN2OFF(bn),n*Q_BLOCKSIZE))
+			{
+				free(buf);
+				func_abort("read error at block %u",bn);
+			}
+			p=buf;
+		}
+		qs_precheck(p,n,maxbn,maxsz,ok);
+		for(i=0;i<n;i++)
+		{
+			if(!ok[i])
+				continue;
+			s->ncand++;
+			memcpy(&h,p+(size_t)i*Q_BLOCKSIZE,sizeof(h));
+			r=(rs!=NULL && (rs[(bn+i)>>3] & (1<<((bn+i)&7)))) ? QSX_REACH : 0;
+			need=QS_NEED(h.size_xtnt);
+			/* exact checks: fits in image and in bound, no self links */
+			if(bn+i+need-1>maxbn || h.bound_xtnt<need || h.prev_xtnt==bn+i || h.next_xtnt==bn+i)
+				continue;
+			/* data of reachable or already found extents, empty extents */
+			if(rs!=NULL && !r && (QS_REACHED(s,bn+i) || bn+i<=cover || !h.size_xtnt))
+				continue;
+			if(qs_add(s,&cap,bn+i,&h,r))
+			{
+				free(buf);
+				return -1;
+			}
+			if(!r)
+				cover=bn+i+need-1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+uint32_t qs_find(qnx_scan *s, uint32_t bn)
+{
+	uint32_t lo=0,hi=s->nx,mid;
+
+	while(lo<hi)
+	{
+		mid=(lo+hi)/2;
+		if(s->x[mid].bn<bn)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return (lo<s->nx && s->x[lo].bn==bn) ? lo : QS_NONE;
+}
+
+static int qs_add_chain(qnx_scan *s, uint32_t *cap, uint32_t first, uint32_t flags)
+{
+	qs_chain *c;
+	uint32_t i,ci=s->nc;
+
+	if(s->nc==*cap)
+	{
+		*cap=*cap ? *cap*2 : 256;
+		if((c=realloc(s->c,*cap*sizeof(qs_chain)))==NULL)
+			func_abort("alloc error!");
+		s->c=c;
+	}
+	c=s->c+s->nc++;
+	c->first=first;
+	c->nx=0;
+	c->size=0;
+	c->flags=flags;
+	if(s->x[first].flags & QSX_REACH)
+		c->flags |= QSC_REACH;
+	if(s->x[first].h.prev_xtnt && !(flags & QSC_CYCLE))
+		c->flags |= QSC_NOHEAD;
+	for(i=first;i!=QS_NONE && s->x[i].chain==QS_NONE;i=s->x[i].next)
+	{
+		s->x[i].chain=ci;
+		c->nx++;
+		c->size+=s->x[i].h.size_xtnt;
+		if(s->x[i].next==QS_NONE && s->x[i].h.next_xtnt)
+			c->flags |= QSC_NOTAIL;
+	}
+	return 0;
+}
+
+/* link extents whose headers agree, then collect chains */
+static int qs_link(qnx_scan *s)
+{
+	uint32_t i,j,cap=0;
+
+	for(i=0;i<s->nx;i++)
+	{
+		if(!s->x[i].h.next_xtnt || (j=qs_find(s,s->x[i].h.next_xtnt))==QS_NONE)
+			continue;
+		if(s->x[j].h.prev_xtnt==s->x[i].bn && s->x[j].prev==QS_NONE)
+		{
+			s->x[i].next=j;
+			s->x[j].prev=i;
+		}
+	}
+	for(i=0;i<s->nx;i++)
+		if(s->x[i].prev==QS_NONE && qs_add_chain(s,&cap,i,0))
+			return -1;
+	/* whatever is left has no start: cycles */
+	for(i=0;i<s->nx;i++)
+		if(s->x[i].chain==QS_NONE && qs_add_chain(s,&cap,i,QSC_CYCLE))
+			return -1;
+	return 0;
+}
+
+int qs_scan(qnx_disk *qd, qnx_scan *s, int flags)
+{
+	qnx_file root;
+	uint8_t *rs;
+	size_t bl;
+
+	memset(s,0,sizeof(qnx_scan));
+	s->qd=qd;
+	s->nblocks=MIN((qd->isize-qd->ioff)/Q_BLOCKSIZE,UINT32_MAX-1);
+	bl=(size_t)s->nblocks/8+1;
+	s->reach=calloc(bl,1);
+	rs=calloc(bl,1);
+	if(s->reach==NULL || rs==NULL)
+	{
+		free(rs);
+		qs_free(s);
+		func_abort("alloc error!");
+	}
+
+	/* superblock, then everything reachable from root */
+	qs_mark(s,1,1);
+	if(flags & QS_ALL)
+	{
+		free(rs);
+		rs=NULL;
+	}
+	else if(qnx_open_root(qd,&root))
+		func_msg("can't open root directory, every extent is an orphan");
+	else
+	{
+		qs_walk(s,&root,rs,0);
+		qnx_close(&root);
+	}
+
+	if(qs_pass(s,rs) || qs_link(s))
+	{
+		free(rs);
+		qs_free(s);
+		return -1;
+	}
+	free(rs);
+	return 0;
+}
+
+void qs_free(qnx_scan *s)
+{
+	free(s->x);
+	free(s->c);
+	free(s->reach);
+	s->x=NULL;
+	s->c=NULL;
+	s->reach=NULL;
+	s->nx=s->nc=0;
+}
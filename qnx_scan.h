@@ -0,0 +1,87 @@
+/* qnx_scan.h - whole image scan for extent headers (orphaned/deleted files)
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* The image is read sequentially, in large chunks, and every block is
+ * checked for a plausible extent header: a cheap range check on the whole
+ * chunk first (one 16 byte compare per block, SSE2 where available), then
+ * exact checks on the blocks that pass. Extents owned by files reachable
+ * from the root directory are marked first (by walking the tree), so file
+ * data that happens to look like a header is not mistaken for one. Valid
+ * headers are linked into chains (next_xtnt/prev_xtnt must agree).
+ * With QS_ALL, nothing is known to be reachable: every valid header is kept,
+ * for callers that work out ownership on their own (qfsck). */
+
+#define QS_NONE		0xffffffff
+#define QS_CHUNK	2048		/* blocks read at once (1MB) */
+
+/* qs_scan flags */
+#define QS_ALL		1<<0		/* don't walk the tree, keep every valid header
+								 * (also those inside other extents) */
+
+/* qs_xtnt flags */
+#define QSX_REACH	1<<0		/* extent of a file reachable from root */
+
+/* qs_chain flags */
+#define QSC_REACH	1<<0		/* chain starts at a reachable extent */
+#define QSC_NOHEAD	1<<1		/* first extent has prev_xtnt set (start lost) */
+#define QSC_NOTAIL	1<<2		/* last extent has next_xtnt set (end lost) */
+#define QSC_CYCLE	1<<3		/* chain loops */
+
+typedef struct qs_xtnt
+{
+	uint32_t bn;
+	struct q_xtnt_header h;
+	uint32_t prev;		/* index of previous extent in chain or QS_NONE */
+	uint32_t next;		/* index of next extent in chain or QS_NONE */
+	uint32_t chain;		/* index of chain */
+	uint32_t flags;
+} qs_xtnt;
+
+typedef struct qs_chain
+{
+	uint32_t first;		/* index of first extent */
+	uint32_t nx;		/* number of extents */
+	uint64_t size;		/* data bytes */
+	uint32_t flags;
+} qs_chain;
+
+typedef struct qnx_scan
+{
+	qnx_disk *qd;
+	uint32_t nblocks;	/* blocks in filesystem (image size after ioff) */
+	qs_xtnt *x;			/* valid headers, sorted by block number */
+	uint32_t nx;
+	qs_chain *c;
+	uint32_t nc;
+	uint8_t *reach;		/* bitmap of blocks owned by reachable extents (not QS_ALL) */
+	uint64_t ncand;		/* blocks passing the range check */
+} qnx_scan;
+
+/* scan qd, filling s (flags: QS_*); returns 0 or -1 on error */
+int qs_scan(qnx_disk *qd, qnx_scan *s, int flags);
+void qs_free(qnx_scan *s);
+
+/* index of the extent starting at block bn, or QS_NONE */
+uint32_t qs_find(qnx_scan *s, uint32_t bn);
+
+#define QS_REACHED(s,bn)	((s)->reach[(bn)>>3] & (1<<((bn)&7)))
@@ -0,0 +1,197 @@
+/* qnx_ur.c - minimal io_uring interface (raw system calls, no liburing)
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "qnx_ur.h"
+
+
+/* the kernel reads the submission ring and writes the completion ring
+ * concurrently: tails/heads are published with release/acquire */
+#define QUR_LOAD(p)		__atomic_load_n(p,__ATOMIC_ACQUIRE)
+#define QUR_STORE(p,v)	__atomic_store_n(p,v,__ATOMIC_RELEASE)
+
+static int qur_enter(int fd, uint32_t submit, uint32_t wait, uint32_t flags)
+{
+	return syscall(__NR_io_uring_enter,fd,submit,wait,flags,NULL,0);
+}
+
+void qur_exit(qd_uring *r)
+{
+	if(r->sqes!=NULL)
+		munmap(r->sqes,r->sqes_len);
+	if(r->cq_ring!=NULL && r->cq_ring!=r->sq_ring)
+		munmap(r->cq_ring,r->cq_len);
+	if(r->sq_ring!=NULL)
+		munmap(r->sq_ring,r->sq_len);
+	if(r->fd!=-1)
+		close(r->fd);
+	memset(r,0,sizeof(qd_uring));
+	r->fd=-1;
+}
+
+int qur_init(qd_uring *r, uint32_t entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq,*cq;
+	void *m;
+
+	memset(r,0,sizeof(qd_uring));
+	memset(&p,0,sizeof(p));
+	if((r->fd=syscall(__NR_io_uring_setup,entries,&p))<0)
+	{
+		r->fd=-1;
+		return -1;
+	}
+	/* IORING_OP_READ/WRITE came with the same kernel (5.6) as this flag */
+	if(!(p.features & IORING_FEAT_RW_CUR_POS))
+	{
+		qur_exit(r);
+		errno=ENOSYS;
+		return -1;
+	}
+	r->entries=p.sq_entries;
+	r->sq_len=p.sq_off.array+p.sq_entries*sizeof(uint32_t);
+	r->cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)	/* both rings in one mapping */
+		r->sq_len=r->cq_len=(r->sq_len > r->cq_len) ? r->sq_len : r->cq_len;
+
+	m=mmap(NULL,r->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	if(m==MAP_FAILED)
+		goto err;
+	r->sq_ring=m;
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring=r->sq_ring;
+	else
+	{
+		m=mmap(NULL,r->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+		if(m==MAP_FAILED)
+			goto err;
+		r->cq_ring=m;
+	}
+	r->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+	m=mmap(NULL,r->sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if(m==MAP_FAILED)
+		goto err;
+	r->sqes=m;
+
+	sq=r->sq_ring;
+	r->sq_head=(uint32_t *)(sq+p.sq_off.head);
+	r->sq_tail=(uint32_t *)(sq+p.sq_off.tail);
+	r->sq_mask=(uint32_t *)(sq+p.sq_off.ring_mask);
+	r->sq_array=(uint32_t *)(sq+p.sq_off.array);
+	cq=r->cq_ring;
+	r->cq_head=(uint32_t *)(cq+p.cq_off.head);
+	r->cq_tail=(uint32_t *)(cq+p.cq_off.tail);
+	r->cq_mask=(uint32_t *)(cq+p.cq_off.ring_mask);
+	r->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+	return 0;
+
+err:
+	qur_exit(r);
+	return -1;
+}
+
+static int qur_prep(qd_uring *r, int op, int fd, const void *buf, uint32_t len, uint64_t off, uint64_t data)
+{
+	uint32_t tail=*r->sq_tail;	/* only we move the tail */
+	uint32_t i;
+	struct io_uring_sqe *sqe;
+
+	if(tail-QUR_LOAD(r->sq_head) >= r->entries)
+		return -1;
+	i=tail & *r->sq_mask;
+	sqe=&r->sqes[i];
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	sqe->opcode=op;
+	sqe->fd=fd;
+	sqe->addr=(uintptr_t)buf;
+	sqe->len=len;
+	sqe->off=off;
+	sqe->user_data=data;
+	r->sq_array[i]=i;
+	QUR_STORE(r->sq_tail,tail+1);
+	r->pending++;
+	return 0;
+}
+
+int qur_read(qd_uring *r, int fd, void *buf, uint32_t len, uint64_t off, uint64_t data)
+{
+	return qur_prep(r,IORING_OP_READ,fd,buf,len,off,data);
+}
+
+int qur_write(qd_uring *r, int fd, const void *buf, uint32_t len, uint64_t off, uint64_t data)
+{
+	return qur_prep(r,IORING_OP_WRITE,fd,buf,len,off,data);
+}
+
+int qur_submit(qd_uring *r, uint32_t wait)
+{
+	int n;
+
+	for(;;)
+	{
+		n=qur_enter(r->fd,r->pending,wait,wait ? IORING_ENTER_GETEVENTS : 0);
+		if(n>=0)
+			break;
+		if(errno!=EINTR)
+			return -1;
+	}
+	r->pending-=n;
+	r->inflight+=n;
+	return 0;
+}
+
+int qur_cqe(qd_uring *r, uint64_t *data, int32_t *res)
+{
+	uint32_t head=*r->cq_head;	/* only we move the head */
+	struct io_uring_cqe *cqe;
+
+	if(head==QUR_LOAD(r->cq_tail))
+		return 0;
+	cqe=&r->cqes[head & *r->cq_mask];
+	*data=cqe->user_data;
+	*res=cqe->res;
+	QUR_STORE(r->cq_head,head+1);
+	r->inflight--;
+	return 1;
+}
+
+int qur_drain(qd_uring *r)
+{
+	uint64_t data;
+	int32_t res;
+
+	for(;;)
+	{
+		while(qur_cqe(r,&data,&res))
+			;
+		if(!r->inflight && !r->pending)
+			return 0;
+		if(qur_submit(r,1))
+			return -1;
+	}
+}
@@ -0,0 +1,68 @@
+/* qnx_ur.h - minimal io_uring interface (raw system calls, no liburing)
+ *
+ * Copyright 2020 Mihai Gaitos, mihaig@hawk.ro
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN
+ * IF THE COPYRIGHT HOLDER HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * THE COPYRIGHT HOLDER SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE COPYRIGHT HOLDER HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/* Just enough of io_uring for qdump's extraction engine: one ring, reads
+ * and writes at explicit offsets. Submission entries are prepared with
+ * qur_read/qur_write, sent (and completions waited for) by qur_submit and
+ * collected with qur_cqe. The kernel may lack io_uring (or forbid it);
+ * qur_init then fails and callers use their synchronous path. */
+
+#include <linux/io_uring.h>
+
+typedef struct qd_uring
+{
+	int fd;					/* -1 = not initialized */
+	uint32_t entries;		/* submission queue size */
+	uint32_t inflight;		/* submitted, not completed yet */
+	uint32_t pending;		/* prepared, not submitted yet */
+	uint32_t *sq_head,*sq_tail,*sq_mask,*sq_array;
+	struct io_uring_sqe *sqes;
+	uint32_t *cq_head,*cq_tail,*cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring,*cq_ring;
+	size_t sq_len,cq_len,sqes_len;
+} qd_uring;
+
+/* set up a ring with (at least) entries submission slots
+ * returns 0, or -1 if io_uring can't be used (errno set) */
+int qur_init(qd_uring *r, uint32_t entries);
+
+/* unmap and close the ring; doesn't wait for I/O, qur_drain first if
+ * anything may still be in flight */
+void qur_exit(qd_uring *r);
+
+/* prepare a read/write of len bytes at off of fd; data comes back with the
+ * completion. returns -1 if the submission queue is full */
+int qur_read(qd_uring *r, int fd, void *buf, uint32_t len, uint64_t off, uint64_t data);
+int qur_write(qd_uring *r, int fd, const void *buf, uint32_t len, uint64_t off, uint64_t data);
+
+/* submit prepared entries and wait for at least wait completions
+ * (0 - don't wait). returns 0 or -1 */
+int qur_submit(qd_uring *r, uint32_t wait);
+
+/* take one completion: 1 if there was one (data, res filled), 0 if none */
+int qur_cqe(qd_uring *r, uint64_t *data, int32_t *res);
+
+/* submit anything prepared and wait until nothing is in flight, throwing
+ * the completions away. returns 0, or -1 (the kernel may still own buffers) */
+int qur_drain(qd_uring *r);